@@ -20,92 +20,87 @@
 #include "Arduino.h"
 #include "AsyncEventSource.h"
 
-static String generateEventMessage(const char* message, const char* event, uint32_t id, uint32_t reconnect) {
-  String ev = "";
+//length of the line starting at p and of the line break ending it (\r\n, \r or \n, 0 at the end)
+static size_t eventLineLength(const char *p, const char *end, size_t *breakLen){
+  const char *e = p;
+  while(e < end && *e != '\r' && *e != '\n')
+    e++;
+  *breakLen = (e == end) ? 0 : ((*e == '\r' && e + 1 < end && e[1] == '\n') ? 2 : 1);
+  return e - p;
+}
 
-  if (reconnect) {
-    ev += "retry: ";
-    ev += String(reconnect);
-    ev += "\r\n";
-  }
+static size_t eventFieldLength(const char *name, uint32_t value){
+  char buf[11];
+  return strlen(name) + 2 + snprintf(buf, sizeof(buf), "%u", (unsigned)value) + 2;
+}
 
-  if (id) {
-    ev += "id: ";
-    ev += String(id);
-    ev += "\r\n";
-  }
+static char * eventWriteField(char *out, const char *name, const char *value, size_t len){
+  size_t nlen = strlen(name);
+  memcpy(out, name, nlen);
+  out += nlen;
+  *out++ = ':';
+  *out++ = ' ';
+  memcpy(out, value, len);
+  out += len;
+  *out++ = '\r';
+  *out++ = '\n';
+  return out;
+}
 
-  if (event != nullptr) {
-    ev += "event: ";
-    ev += String(event);
-    ev += "\r\n";
-  }
+static char * eventWriteNumber(char *out, const char *name, uint32_t value){
+  char buf[11];
+  return eventWriteField(out, name, buf, snprintf(buf, sizeof(buf), "%u", (unsigned)value));
+}
 
-  if (message != nullptr) {
-    size_t messageLen = strlen(message);
-    const char * lineStart = message;
-    char* lineEnd;
+//exact length of the event generateEventMessage() writes
+static size_t eventMessageLength(const char *message, size_t len, const char *event, uint32_t id, uint32_t reconnect){
+  size_t total = 2;
+  if(reconnect)
+    total += eventFieldLength("retry", reconnect);
+  if(id)
+    total += eventFieldLength("id", id);
+  if(event != nullptr)
+    total += 7 + strlen(event) + 2;
+  if(message != nullptr){
+    //every line becomes a data field, a break at the very end does not start another one
+    const char *p = message, *end = message + len;
     do {
-      char* nextN = strchr(lineStart, '\n');
-      char* nextR = strchr(lineStart, '\r');
-      if (nextN == nullptr && nextR == nullptr) {
-        size_t llen = ((message + messageLen) - lineStart);
-        std::unique_ptr<char[]> ldata(new char[llen + 1]);
-        if (ldata != nullptr) {
-          memcpy(ldata.get(), lineStart, llen);
-          ldata[llen] = 0;
-          ev += "data: ";
-          ev += ldata.get();
-          ev += "\r\n\r\n";
-        }
-        lineStart = (message + messageLen);
-      } else {
-        char* nextLine = nullptr;
-        if (nextN != nullptr && nextR != nullptr) {
-          if (nextR < nextN) {
-            lineEnd = nextR;
-            if (nextN == (nextR + 1))
-              nextLine = nextN + 1;
-            else
-              nextLine = nextR + 1;
-          } else {
-            lineEnd = nextN;
-            if (nextR == (nextN + 1))
-              nextLine = nextR + 1;
-            else
-              nextLine = nextN + 1;
-          }
-        } else if (nextN != nullptr) {
-          lineEnd = nextN;
-          nextLine = nextN + 1;
-        } else {
-          lineEnd = nextR;
-          nextLine = nextR + 1;
-        }
-
-        size_t llen = lineEnd - lineStart;
-        std::unique_ptr<char[]> ldata(new char[llen + 1]);
-        if (ldata != nullptr) {
-          memcpy(ldata.get(), lineStart, llen);
-          ldata[llen] = 0;
-          ev += "data: ";
-          ev += ldata.get();
-          ev += "\r\n";
-        }
-        lineStart = nextLine;
-        if (lineStart == (message + messageLen))
-          ev += "\r\n";
-      }
-    } while (lineStart < (message + messageLen));
+      size_t breakLen;
+      size_t llen = eventLineLength(p, end, &breakLen);
+      total += 6 + llen + 2;
+      p += llen + breakLen;
+    } while(p < end);
   }
+  return total;
+}
 
-  return ev;
+//writes the event to out, which has room for eventMessageLength() bytes. The message may contain any bytes
+static size_t generateEventMessage(char *out, const char *message, size_t len, const char *event, uint32_t id, uint32_t reconnect){
+  char *o = out;
+  if(reconnect)
+    o = eventWriteNumber(o, "retry", reconnect);
+  if(id)
+    o = eventWriteNumber(o, "id", id);
+  if(event != nullptr)
+    o = eventWriteField(o, "event", event, strlen(event));
+  if(message != nullptr){
+    const char *p = message, *end = message + len;
+    do {
+      size_t breakLen;
+      size_t llen = eventLineLength(p, end, &breakLen);
+      o = eventWriteField(o, "data", p, llen);
+      p += llen + breakLen;
+    } while(p < end);
+  }
+  *o++ = '\r';
+  *o++ = '\n';
+  return o - out;
 }
 
-// Message
+// Message buffer
 
-AsyncEventSourceMessage::AsyncEventSourceMessage(const char * data, size_t len)
-: _data(nullptr), _len(len), _sent(0), _acked(0)
+AsyncEventSourceMessageBuffer::AsyncEventSourceMessageBuffer(const char * data, size_t len)
+: _data(nullptr), _len(len), _count(0), _id(0), _event(0), _eventLen(0)
 {
   _data = new uint8_t[_len + 1];
   if(_data == nullptr){
@@ -116,11 +111,59 @@ AsyncEventSourceMessage::AsyncEventSourceMessage(const char * data, size_t len)
   }
 }
 
-AsyncEventSourceMessage::~AsyncEventSourceMessage() {
+AsyncEventSourceMessageBuffer::AsyncEventSourceMessageBuffer(const char *message, size_t len, const char *event, uint32_t id, uint32_t reconnect)
+: _data(nullptr), _len(eventMessageLength(message, len, event, id, reconnect)), _count(0), _id(id), _event(0), _eventLen(0)
+{
+  _data = new uint8_t[_len + 1];
+  if(_data == nullptr){
+    _len = 0;
+  } else {
+    generateEventMessage((char *)_data, message, len, event, id, reconnect);
+    _data[_len] = 0;
+    //the name stays in the formatted event, right after "event: "
+    if(event != nullptr){
+      _event = (reconnect ? eventFieldLength("retry", reconnect) : 0) + (id ? eventFieldLength("id", id) : 0) + 7;
+      _eventLen = strlen(event);
+    }
+  }
+}
+
+AsyncEventSourceMessageBuffer::~AsyncEventSourceMessageBuffer() {
      if(_data != nullptr)
         delete[] _data;
 }
 
+bool AsyncEventSourceMessageBuffer::sameEvent(const AsyncEventSourceMessageBuffer *buffer) const {
+  return _eventLen && _eventLen == buffer->_eventLen && memcmp(_data + _event, buffer->_data + buffer->_event, _eventLen) == 0;
+}
+
+void AsyncEventSourceMessageBuffer::release() {
+  if(_count > 0)
+    _count--;
+  if(!_count)
+    delete this;
+}
+
+// Message
+
+AsyncEventSourceMessage::AsyncEventSourceMessage(AsyncEventSourceMessageBuffer * buffer)
+: _buffer(buffer), _len(buffer->length()), _sent(0), _acked(0)
+{
+  _buffer->retain();
+}
+
+AsyncEventSourceMessage::AsyncEventSourceMessage(const char * data, size_t len)
+: AsyncEventSourceMessage(new AsyncEventSourceMessageBuffer(data, len))
+{}
+
+AsyncEventSourceMessage::AsyncEventSourceMessage(const char *message, size_t len, const char *event, uint32_t id, uint32_t reconnect)
+: AsyncEventSourceMessage(new AsyncEventSourceMessageBuffer(message, len, event, id, reconnect))
+{}
+
+AsyncEventSourceMessage::~AsyncEventSourceMessage() {
+  _buffer->release();
+}
+
 size_t AsyncEventSourceMessage::ack(size_t len, uint32_t time) {
   // If the whole message is now acked...
   if(_acked + len > _len){
@@ -134,26 +177,38 @@ size_t AsyncEventSourceMessage::ack(size_t len, uint32_t time) {
   return 0;
 }
 
+//adds as much of the event as the window takes, the client flushes everything it added at once
 size_t AsyncEventSourceMessage::send(AsyncClient *client) {
-  const size_t len = _len - _sent;
-  if(client->space() < len){
+  if(!client->canSend())
     return 0;
-  }
-  size_t sent = client->add((const char *)_data, len);
-  if(client->canSend())
-    client->send();
+  size_t len = _len - _sent;
+  if(len > client->space())
+    len = client->space();
+  if(!len)
+    return 0;
+  size_t sent = client->add((const char *)_buffer->get() + _sent, len);
   _sent += sent;
-  return sent; 
+  return sent;
 }
 
 // Client
 
 AsyncEventSourceClient::AsyncEventSourceClient(AsyncWebServerRequest *request, AsyncEventSource *server)
-: _messageQueue(LinkedList<AsyncEventSourceMessage *>([](AsyncEventSourceMessage *m){ delete  m; }))
+: _messageQueue(server->maxQueuedMessages(), [](AsyncEventSourceMessage * const &m){ delete  m; })
+, _stallTimer([this](){ _onStall(); })
 {
   _client = request->client();
   _server = server;
   _lastId = 0;
+  _resumed = false;
+  _closing = false;
+  _active = false;
+  _sendIndex = 0;
+  _queueHighWatermark = 0;
+  _queued = 0;
+  _dropped = 0;
+  _coalesced = 0;
+  _backpressure = server->backpressure();
   if(request->hasHeader(F("Last-Event-ID")))
     _lastId = atoi(request->getHeader(F("Last-Event-ID"))->value().c_str());
     
@@ -174,33 +229,119 @@ AsyncEventSourceClient::~AsyncEventSourceClient(){
   close();
 }
 
+void AsyncEventSourceClient::setBackpressure(SseBackpressurePolicy policy){
+  AsyncWebLockGuard l(_server->_lock);
+  _backpressure = policy;
+}
+
+SseQueueStats AsyncEventSourceClient::queueStats() const {
+  SseQueueStats stats;
+  stats.length = _messageQueue.length();
+  stats.capacity = _messageQueue.capacity();
+  stats.highWatermark = _queueHighWatermark;
+  stats.queued = _queued;
+  stats.dropped = _dropped;
+  stats.coalesced = _coalesced;
+  return stats;
+}
+
 void AsyncEventSourceClient::_queueMessage(AsyncEventSourceMessage *dataMessage){
   if(dataMessage == NULL)
     return;
-  if(!connected()){
+  AsyncWebLockGuard l(_server->_lock);
+  //an empty event (or one whose buffer could not be allocated) has nothing to send and would never be acked
+  if(!connected() || _closing || dataMessage->finished()){
     delete dataMessage;
     return;
   }
+  //only messages behind _sendIndex are untouched and can be replaced or dropped
+  if(_backpressure == SSE_QUEUE_COALESCE){
+    //latest value wins, it takes the place of a queued event with the same name
+    for(size_t i = _sendIndex; i < _messageQueue.length(); i++){
+      AsyncEventSourceMessage *m = _messageQueue[i];
+      if(m->unsent() && m->buffer()->sameEvent(dataMessage->buffer())){
+        _messageQueue[i] = dataMessage;
+        delete m;
+        _coalesced++;
+        return;
+      }
+    }
+  }
+  if(_messageQueue.isFull()){
+    if(_backpressure == SSE_QUEUE_DISCONNECT){
+      //closing here could delete the client while the server walks its clients, the stall timer closes it instead
+      DEBUGF("ERROR: Too many events queued, disconnecting\n");
+      _dropped++;
+      delete dataMessage;
+      _closing = true;
+      _server->_timers().schedule(&_stallTimer, 0);
+      return;
+    }
+    if(_backpressure == SSE_QUEUE_DROP_OLDEST){
+      for(size_t i = _sendIndex; i < _messageQueue.length(); i++){
+        if(_messageQueue[i]->unsent()){
+          _messageQueue.remove_at(i);
+          _dropped++;
+          break;
+        }
+      }
+    }
+  }
 
-  _messageQueue.add(dataMessage);
+  if(_messageQueue.isEmpty() && _server->_stallTimeoutMs())
+    _server->_timers().schedule(&_stallTimer, _server->_stallTimeoutMs());
+  if(!_messageQueue.add(dataMessage)){
+    DEBUGF("ERROR: Too many events queued\n");
+    _dropped++;
+    delete dataMessage;
+    return;
+  }
+  _queued++;
+  _active = true;
+  if(_messageQueue.length() > _queueHighWatermark)
+    _queueHighWatermark = _messageQueue.length();
 
   _runQueue();
 }
 
 void AsyncEventSourceClient::_onAck(size_t len, uint32_t time){
-  while(len && !_messageQueue.isEmpty()){
-    len = _messageQueue.front()->ack(len, time);
-    if(_messageQueue.front()->finished())
-      _messageQueue.remove(_messageQueue.front());
+  AsyncWebLockGuard l(_server->_lock);
+  while(!_messageQueue.isEmpty()){
+    AsyncEventSourceMessage *m = _messageQueue.front();
+    if(!m->finished()){
+      if(!len || m->unsent())
+        break;
+      len = m->ack(len, time);
+      if(!m->finished())
+        break;
+    }
+    _messageQueue.pop_front();
+    if(_sendIndex)
+      _sendIndex--;
+  }
+  //the client is reading, give the rest of the queue a new deadline
+  if(!_closing){
+    if(_messageQueue.isEmpty())
+      _server->_timers().cancel(&_stallTimer);
+    else if(_server->_stallTimeoutMs())
+      _server->_timers().schedule(&_stallTimer, _server->_stallTimeoutMs());
   }
 
   _runQueue();
 }
 
 void AsyncEventSourceClient::_onPoll(){
+  AsyncWebLockGuard l(_server->_lock);
   if(!_messageQueue.isEmpty()){
     _runQueue();
   }
+  //stall deadlines of all clients, this one included, so nothing may follow
+  _server->_timers().advance(millis());
+}
+
+void AsyncEventSourceClient::_onStall(){
+  if(_client != NULL)
+    _client->close(true);
 }
 
 
@@ -209,6 +350,7 @@ void AsyncEventSourceClient::_onTimeout(uint32_t time __attribute__((unused))){
 }
 
 void AsyncEventSourceClient::_onDisconnect(){
+  AsyncWebLockGuard l(_server->_lock);
   _client = NULL;
   _server->_handleDisconnect(this);
 }
@@ -222,21 +364,32 @@ void AsyncEventSourceClient::write(const char * message, size_t len){
   _queueMessage(new AsyncEventSourceMessage(message, len));
 }
 
+void AsyncEventSourceClient::write(AsyncEventSourceMessageBuffer * buffer){
+  _queueMessage(new AsyncEventSourceMessage(buffer));
+}
+
 void AsyncEventSourceClient::send(const char *message, const char *event, uint32_t id, uint32_t reconnect){
-  String ev = generateEventMessage(message, event, id, reconnect);
-  _queueMessage(new AsyncEventSourceMessage(ev.c_str(), ev.length()));
+  _queueMessage(new AsyncEventSourceMessage(message, (message != nullptr) ? strlen(message) : 0, event, id, reconnect));
 }
 
-void AsyncEventSourceClient::_runQueue(){
-  while(!_messageQueue.isEmpty() && _messageQueue.front()->finished()){
-    _messageQueue.remove(_messageQueue.front());
-  }
+void AsyncEventSourceClient::send(const uint8_t *message, size_t len, const char *event, uint32_t id, uint32_t reconnect){
+  _queueMessage(new AsyncEventSourceMessage((const char *)message, len, event, id, reconnect));
+}
 
-  for(auto i = _messageQueue.begin(); i != _messageQueue.end(); ++i)
-  {
-    if(!(*i)->sent())
-      (*i)->send(_client);
+void AsyncEventSourceClient::_runQueue(){
+  //messages go out in order, everything in front of _sendIndex has been handed to the client.
+  //as many events as the window takes go out in one send, the rest of a large one follows the acks
+  bool added = false;
+  while(_sendIndex < _messageQueue.length()){
+    AsyncEventSourceMessage *m = _messageQueue[_sendIndex];
+    if(m->send(_client))
+      added = true;
+    if(!m->sent())
+      break;
+    _sendIndex++;
   }
+  if(added)
+    _client->send();
 }
 
 
@@ -245,16 +398,106 @@ void AsyncEventSourceClient::_runQueue(){
 AsyncEventSource::AsyncEventSource(const String& url)
   : _url(url)
   , _clients(LinkedList<AsyncEventSourceClient *>([](AsyncEventSourceClient *c){ delete c; }))
+  , _iterating(0)
+  , _removePending(false)
   , _connectcb(NULL)
-{}
+  , _stallTimeout(SSE_STALL_TIMEOUT * 1000)
+  , _replay(NULL)
+  , _replayMaxBytes(0)
+  , _replayBytes(0)
+  , _maxQueuedMessages(SSE_MAX_QUEUED_MESSAGES)
+  , _backpressure(SSE_QUEUE_DROP_NEWEST)
+  , _heartbeatInterval(SSE_HEARTBEAT_INTERVAL * 1000)
+  , _heartbeatTimer([this](){ _onHeartbeat(); })
+  , _heartbeat(new AsyncEventSourceMessageBuffer(":\n\n", 3))
+  , _retry(0)
+{
+  _heartbeat->retain();
+  if(_heartbeatInterval)
+    _timerWheel.schedule(&_heartbeatTimer, _heartbeatInterval);
+}
 
 AsyncEventSource::~AsyncEventSource(){
   close();
+  setReplayBuffer(0, 0);
+  _heartbeat->release();
+}
+
+void AsyncEventSource::setHeartbeat(uint16_t seconds){
+  AsyncWebLockGuard l(_lock);
+  _heartbeatInterval = seconds * 1000;
+  if(_heartbeatInterval)
+    _timerWheel.schedule(&_heartbeatTimer, _heartbeatInterval);
+  else
+    _timerWheel.cancel(&_heartbeatTimer);
+}
+
+void AsyncEventSource::_onHeartbeat(){
+  //one comment frame, shared by every client that got nothing since the last heartbeat
+  _iterating++;
+  for(const auto &c: _clients){
+    if(c->connected() && !c->_active && c->_messageQueue.isEmpty())
+      c->write(_heartbeat);
+    c->_active = false;
+  }
+  _endIteration();
+  if(_heartbeatInterval)
+    _timerWheel.schedule(&_heartbeatTimer, _heartbeatInterval);
+}
+
+void AsyncEventSource::setReplayBuffer(size_t events, size_t bytes){
+  AsyncWebLockGuard l(_lock);
+  if(_replay != NULL){
+    _replay->free();
+    delete _replay;
+    _replay = NULL;
+  }
+  _replayBytes = 0;
+  _replayMaxBytes = bytes;
+  if(events && bytes)
+    _replay = new RingQueue<AsyncEventSourceMessageBuffer *>(events, [](AsyncEventSourceMessageBuffer *b){ b->release(); });
+}
+
+void AsyncEventSource::_addReplay(AsyncEventSourceMessageBuffer *buffer){
+  if(_replay == NULL)
+    return;
+  //an event that cannot be kept leaves a gap, nothing before it can be resumed from
+  if(buffer->length() > _replayMaxBytes){
+    _replay->free();
+    _replayBytes = 0;
+    return;
+  }
+  while(!_replay->isEmpty() && (_replay->isFull() || _replayBytes + buffer->length() > _replayMaxBytes)){
+    _replayBytes -= _replay->front()->length();
+    _replay->pop_front();
+  }
+  buffer->retain();
+  _replay->add(buffer);
+  _replayBytes += buffer->length();
+}
+
+void AsyncEventSource::_replayTo(AsyncEventSourceClient *client){
+  if(_replay == NULL || !client->lastId())
+    return;
+  //the client has seen everything up to the newest event with its id
+  size_t i = _replay->length();
+  while(i && (*_replay)[i - 1]->id() != client->lastId())
+    i--;
+  if(!i)
+    return;
+  //a replay that does not fit the queue would lose events, the client is better off with a full snapshot
+  const RingQueue<AsyncEventSourceMessage *> &queue = client->_messageQueue;
+  if(_replay->length() - i > queue.capacity() - queue.length())
+    return;
+  uint32_t dropped = client->_dropped;
+  uint32_t coalesced = client->_coalesced;
+  for(; i < _replay->length(); i++)
+    client->write((*_replay)[i]);
+  client->_resumed = (client->_dropped == dropped && client->_coalesced == coalesced);
 }
 
 void AsyncEventSource::onConnect(ArEventHandlerFunction cb){
-   if(_clients.isEmpty())
-   _semaphore = false;
+  AsyncWebLockGuard l(_lock);
   _connectcb = cb;
 }
 
@@ -272,45 +515,71 @@ void AsyncEventSource::_addClient(AsyncEventSourceClient * client){
     free(temp);
   }*/
   
-  if(!_semaphore){
-      _clients.add(client);
-      if(_connectcb)
-      _connectcb(client);
-  }    
+  ArEventHandlerFunction connectcb;
+  {
+    AsyncWebLockGuard l(_lock);
+    _clients.add(client);
+    if(_retry)
+      client->send((const char *)NULL, NULL, 0, _retry);
+    _replayTo(client);
+    connectcb = _connectcb;
+  }
+  //called without the lock, the callback may wait on a task that sends
+  if(connectcb)
+    connectcb(client);
 }
 
 void AsyncEventSource::_handleDisconnect(AsyncEventSourceClient * client){
-  _semaphore = true;
+  AsyncWebLockGuard l(_lock);
+  //while the list is walked the client stays in it, disconnected, and is removed once the walk is over
+  if(_iterating){
+    _removePending = true;
+    return;
+  }
   _clients.remove(client);
-  _semaphore = false;
 }
 
-inline void AsyncEventSource::close(){
+void AsyncEventSource::_endIteration(){
+  if(--_iterating || !_removePending)
+    return;
+  _removePending = false;
+  while(_clients.remove_first([](AsyncEventSourceClient *c){ return c->client() == NULL; }));
+}
 
+void AsyncEventSource::close(){
+  AsyncWebLockGuard l(_lock);
+  _iterating++;
   for(const auto &c: _clients){
-    if(c->connected())   
-      _semaphore = true;
+    if(c->connected())
       c->close();
   }
+  _endIteration();
 }
 
 void AsyncEventSource::send(const char *message, const char *event, uint32_t id, uint32_t reconnect){
-  if(_clients.isEmpty()){
-    _semaphore = false;
+  send((const uint8_t *)message, (message != nullptr) ? strlen(message) : 0, event, id, reconnect);
+}
+
+void AsyncEventSource::send(const uint8_t *message, size_t len, const char *event, uint32_t id, uint32_t reconnect){
+  AsyncWebLockGuard l(_lock);
+  if(_clients.isEmpty() && _replay == NULL)
     return;
-  }    
 
-  String ev = generateEventMessage(message, event, id, reconnect);
+  //formatted once, the queue of every client references the same bytes
+  AsyncEventSourceMessageBuffer *buffer = new AsyncEventSourceMessageBuffer((const char *)message, len, event, id, reconnect);
+  buffer->retain();
+  _addReplay(buffer);
+  _iterating++;
   for(const auto &c: _clients){
-    if(c->connected()) {
-      if(!_semaphore){
-      c->write(ev.c_str(), ev.length());
-      }
-    }
+    if(c->connected())
+      c->write(buffer);
   }
+  _endIteration();
+  buffer->release();
 }
 
 size_t AsyncEventSource::count() const {
+  AsyncWebLockGuard l(_lock);
   return _clients.count_if([](AsyncEventSourceClient *c){
     return c->connected();
   });
@@ -325,11 +594,9 @@ bool AsyncEventSource::canHandle(AsyncWebServerRequest *request){
 }
 
 void AsyncEventSource::handleRequest(AsyncWebServerRequest *request){
-  if(!_semaphore){
   if((_username != "" && _password != "") && !request->authenticate(_username.c_str(), _password.c_str()))
     return request->requestAuthentication();
   request->send(new AsyncEventSourceResponse(this));
-  }
 }
 
 // Response
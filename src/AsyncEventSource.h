@@ -27,26 +27,97 @@
 #include <ESPAsyncTCP.h>
 #endif
 #include <ESPAsyncWebServer.h>
+#include "AsyncTimerWheel.h"
+#include "AsyncWebSynchronization.h"
+
+//seconds a client may keep events queued without acknowledging any of them before it is closed
+#ifndef SSE_STALL_TIMEOUT
+#define SSE_STALL_TIMEOUT 30
+#endif
+
+//seconds without events after which a client gets a comment to keep proxies from closing the stream, 0 disables it
+#ifndef SSE_HEARTBEAT_INTERVAL
+#define SSE_HEARTBEAT_INTERVAL 0
+#endif
+
+//events a client can have queued, the queue of a client that does not read stops growing here
+#ifndef SSE_MAX_QUEUED_MESSAGES
+#ifdef ESP32
+#define SSE_MAX_QUEUED_MESSAGES 32
+#else
+#define SSE_MAX_QUEUED_MESSAGES 8
+#endif
+#endif
 
 class AsyncEventSource;
 class AsyncEventSourceResponse;
 class AsyncEventSourceClient;
 typedef std::function<void(AsyncEventSourceClient *client)> ArEventHandlerFunction;
 
+//what happens to an event sent to a client whose queue is full
+typedef enum { SSE_QUEUE_DROP_NEWEST, SSE_QUEUE_DROP_OLDEST, SSE_QUEUE_COALESCE, SSE_QUEUE_DISCONNECT } SseBackpressurePolicy;
+
+typedef struct {
+    /** Events in the queue, sent ones that are not acked yet included. */
+    size_t length;
+    /** Events the queue can hold. */
+    size_t capacity;
+    /** Longest the queue has been. */
+    size_t highWatermark;
+    /** Events added to the queue. */
+    uint32_t queued;
+    /** Events dropped because the queue was full. */
+    uint32_t dropped;
+    /** Events replaced by a newer one with the same name. */
+    uint32_t coalesced;
+} SseQueueStats;
+
+//formatted event shared by the messages of all clients it is sent to, it frees itself when the last one is released
+class AsyncEventSourceMessageBuffer {
+  private:
+    uint8_t * _data;
+    size_t _len;
+    uint32_t _count;
+    uint32_t _id;
+    size_t _event;
+    size_t _eventLen;
+    ~AsyncEventSourceMessageBuffer();
+  public:
+    AsyncEventSourceMessageBuffer(const char * data, size_t len);
+    AsyncEventSourceMessageBuffer(const char *message, size_t len, const char *event, uint32_t id, uint32_t reconnect);
+    AsyncEventSourceMessageBuffer(const AsyncEventSourceMessageBuffer &) = delete;
+    AsyncEventSourceMessageBuffer & operator=(const AsyncEventSourceMessageBuffer &) = delete;
+    const uint8_t * get() const { return _data; }
+    size_t length() const { return _len; }
+    uint32_t count() const { return _count; }
+    //id the event was sent with, 0 for none
+    uint32_t id() const { return _id; }
+    //both events were sent with the same event name
+    bool sameEvent(const AsyncEventSourceMessageBuffer *buffer) const;
+    void retain() { _count++; }
+    void release();
+};
+
 class AsyncEventSourceMessage {
   private:
-    uint8_t * _data; 
+    AsyncEventSourceMessageBuffer * _buffer;
     size_t _len;
     size_t _sent;
     //size_t _ack;
     size_t _acked; 
   public:
+    AsyncEventSourceMessage(AsyncEventSourceMessageBuffer * buffer);
     AsyncEventSourceMessage(const char * data, size_t len);
+    //formats the event straight into the message, the data may contain any bytes
+    AsyncEventSourceMessage(const char *message, size_t len, const char *event, uint32_t id, uint32_t reconnect);
     ~AsyncEventSourceMessage();
     size_t ack(size_t len, uint32_t time __attribute__((unused)));
     size_t send(AsyncClient *client);
     bool finished(){ return _acked == _len; }
     bool sent() { return _sent == _len; }
+    //nothing of the event has been handed to the client, it can still be dropped or replaced
+    bool unsent() { return _sent == 0; }
+    AsyncEventSourceMessageBuffer * buffer() const { return _buffer; }
 };
 
 class AsyncEventSourceClient {
@@ -54,9 +125,23 @@ class AsyncEventSourceClient {
     AsyncClient *_client;
     AsyncEventSource *_server;
     uint32_t _lastId;
-    LinkedList<AsyncEventSourceMessage *> _messageQueue;
+    bool _resumed;
+    //the queue overflowed with SSE_QUEUE_DISCONNECT, the stall timer closes the client
+    bool _closing;
+    //an event was queued since the last heartbeat
+    bool _active;
+    RingQueue<AsyncEventSourceMessage *> _messageQueue;
+    //messages in front of this one have been handed to the client
+    size_t _sendIndex;
+    size_t _queueHighWatermark;
+    uint32_t _queued;
+    uint32_t _dropped;
+    uint32_t _coalesced;
+    SseBackpressurePolicy _backpressure;
+    AsyncTimer _stallTimer;
     void _queueMessage(AsyncEventSourceMessage *dataMessage);
     void _runQueue();
+    void _onStall();
 
   public:
 
@@ -66,23 +151,54 @@ class AsyncEventSourceClient {
     AsyncClient* client(){ return _client; }
     void close();
     void write(const char * message, size_t len);
+    void write(AsyncEventSourceMessageBuffer * buffer);
     void send(const char *message, const char *event=NULL, uint32_t id=0, uint32_t reconnect=0);
+    void send(const uint8_t *message, size_t len, const char *event=NULL, uint32_t id=0, uint32_t reconnect=0);
     bool connected() const { return (_client != NULL) && _client->connected(); }
     uint32_t lastId() const { return _lastId; }
+    //the events missed since lastId() were replayed when the client connected
+    bool resumed() const { return _resumed; }
+    //what happens to events sent while the queue is full, the server setting by default
+    void setBackpressure(SseBackpressurePolicy policy);
+    SseBackpressurePolicy backpressure() const { return _backpressure; }
+    SseQueueStats queueStats() const;
 
     //system callbacks (do not call)
     void _onAck(size_t len, uint32_t time);
     void _onPoll(); 
     void _onTimeout(uint32_t time);
     void _onDisconnect();
+
+    friend AsyncEventSource;
 };
 
 class AsyncEventSource: public AsyncWebHandler {
   private:
     String _url;
-    bool _semaphore = false;
     LinkedList<AsyncEventSourceClient *> _clients;
+    //guards the clients and their queues, sends may come from other tasks than the network callbacks
+    mutable AsyncWebLock _lock;
+    //nesting depth of walks over _clients, disconnects during a walk are removed when it ends
+    uint8_t _iterating;
+    bool _removePending;
+    void _endIteration();
     ArEventHandlerFunction _connectcb;
+    uint32_t _stallTimeout;
+    AsyncTimerWheel _timerWheel;
+    RingQueue<AsyncEventSourceMessageBuffer *> *_replay;
+    size_t _replayMaxBytes;
+    size_t _replayBytes;
+    size_t _maxQueuedMessages;
+    SseBackpressurePolicy _backpressure;
+    uint32_t _heartbeatInterval;
+    AsyncTimer _heartbeatTimer;
+    AsyncEventSourceMessageBuffer *_heartbeat;
+    uint32_t _retry;
+    void _onHeartbeat();
+    void _addReplay(AsyncEventSourceMessageBuffer *buffer);
+    void _replayTo(AsyncEventSourceClient *client);
+
+    friend AsyncEventSourceClient;
   public:
     AsyncEventSource(const String& url);
     ~AsyncEventSource();
@@ -91,11 +207,32 @@ class AsyncEventSource: public AsyncWebHandler {
     void close();
     void onConnect(ArEventHandlerFunction cb);
     void send(const char *message, const char *event=NULL, uint32_t id=0, uint32_t reconnect=0);
+    void send(const uint8_t *message, size_t len, const char *event=NULL, uint32_t id=0, uint32_t reconnect=0);
     size_t count() const; //number clinets connected
+    //close clients that acknowledge none of their queued events for this many seconds, 0 disables it
+    void setStallTimeout(uint16_t seconds){ AsyncWebLockGuard l(_lock); _stallTimeout = seconds * 1000; }
+    uint16_t stallTimeout() const { return (uint16_t)(_stallTimeout / 1000); }
+    //keep the last events, up to this many and this many bytes, for clients that reconnect with a Last-Event-ID, 0 disables it
+    void setReplayBuffer(size_t events, size_t bytes);
+    //capacity of the event queue of clients that connect from now on, SSE_MAX_QUEUED_MESSAGES by default
+    void setMaxQueuedMessages(size_t count){ AsyncWebLockGuard l(_lock); _maxQueuedMessages = count ? count : 1; }
+    size_t maxQueuedMessages() const { return _maxQueuedMessages; }
+    //what clients that connect from now on do when their queue is full, SSE_QUEUE_DROP_NEWEST by default
+    void setBackpressure(SseBackpressurePolicy policy){ AsyncWebLockGuard l(_lock); _backpressure = policy; }
+    SseBackpressurePolicy backpressure() const { return _backpressure; }
+    //clients that got no event for this many seconds get an empty comment, SSE_HEARTBEAT_INTERVAL by default, 0 disables it
+    void setHeartbeat(uint16_t seconds);
+    uint16_t heartbeat() const { return (uint16_t)(_heartbeatInterval / 1000); }
+    //reconnect delay in milliseconds sent to every client when it connects, 0 leaves the browser default
+    void setRetry(uint32_t ms){ AsyncWebLockGuard l(_lock); _retry = ms; }
+    uint32_t retry() const { return _retry; }
 
     //system callbacks (do not call)
     void _addClient(AsyncEventSourceClient * client);
     void _handleDisconnect(AsyncEventSourceClient * client);
+    uint32_t _stallTimeoutMs() const { return _stallTimeout; }
+    //stall deadlines of all clients, advanced from their polls
+    AsyncTimerWheel & _timers(){ return _timerWheel; }
     virtual bool canHandle(AsyncWebServerRequest *request) override final;
     virtual void handleRequest(AsyncWebServerRequest *request) override final;
 };
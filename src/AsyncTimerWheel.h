@@ -0,0 +1,183 @@
+/*
+  Asynchronous WebServer library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef ASYNCTIMERWHEEL_H_
+#define ASYNCTIMERWHEEL_H_
+
+#include "Arduino.h"
+#include <functional>
+
+//number of slots, timers further away than this many ticks go round more than once
+#ifndef ASYNC_TIMER_WHEEL_SLOTS
+#define ASYNC_TIMER_WHEEL_SLOTS 32
+#endif
+
+//milliseconds per tick, timers fire at most this late
+#ifndef ASYNC_TIMER_WHEEL_RESOLUTION
+#define ASYNC_TIMER_WHEEL_RESOLUTION 1000
+#endif
+
+class AsyncTimerWheel;
+
+typedef std::function<void(void)> AsyncTimerHandler;
+
+/*
+ * A deadline kept in an AsyncTimerWheel, usually a member of the object it belongs to.
+ * It leaves the wheel when it fires, when it is cancelled and when it is destroyed.
+ */
+class AsyncTimer {
+  private:
+    AsyncTimerHandler _handler;
+    AsyncTimerWheel *_wheel;
+    AsyncTimer *_prev;
+    AsyncTimer *_next;
+    uint32_t _tick;
+    uint8_t _slot;
+
+    friend class AsyncTimerWheel;
+
+  public:
+    AsyncTimer(AsyncTimerHandler handler) : _handler(handler), _wheel(NULL), _prev(NULL), _next(NULL), _tick(0), _slot(0) {}
+    inline ~AsyncTimer();
+    AsyncTimer(const AsyncTimer&) = delete;
+    AsyncTimer& operator=(const AsyncTimer&) = delete;
+
+    bool armed() const { return _wheel != NULL; }
+};
+
+/*
+ * Hashed timer wheel shared by all clients of a server.
+ * Scheduling and cancelling are O(1), advance() only walks the slots of the ticks that passed
+ * and returns right away when the tick did not change, so it can be called from every poll.
+ */
+class AsyncTimerWheel {
+  private:
+    //the extra slot holds the timers of the tick being processed
+    AsyncTimer *_slots[ASYNC_TIMER_WHEEL_SLOTS + 1];
+    uint32_t _tick;
+    uint32_t _elapsed;
+    uint32_t _lastMillis;
+    size_t _count;
+
+    void _link(AsyncTimer *t, uint8_t slot){
+      t->_slot = slot;
+      t->_prev = NULL;
+      t->_next = _slots[slot];
+      if(t->_next)
+        t->_next->_prev = t;
+      _slots[slot] = t;
+    }
+    void _unlink(AsyncTimer *t){
+      if(t->_prev)
+        t->_prev->_next = t->_next;
+      else
+        _slots[t->_slot] = t->_next;
+      if(t->_next)
+        t->_next->_prev = t->_prev;
+      t->_prev = t->_next = NULL;
+    }
+
+  public:
+    AsyncTimerWheel() : _tick(0), _elapsed(0), _lastMillis(0), _count(0) {
+      for(size_t i = 0; i <= ASYNC_TIMER_WHEEL_SLOTS; i++)
+        _slots[i] = NULL;
+    }
+    ~AsyncTimerWheel(){
+      for(size_t i = 0; i <= ASYNC_TIMER_WHEEL_SLOTS; i++){
+        while(_slots[i])
+          cancel(_slots[i]);
+      }
+    }
+    AsyncTimerWheel(const AsyncTimerWheel&) = delete;
+    AsyncTimerWheel& operator=(const AsyncTimerWheel&) = delete;
+
+    size_t count() const { return _count; }
+
+    //fires the timer once, ms from now, replacing the deadline it had
+    void schedule(AsyncTimer *t, uint32_t ms){
+      cancel(t);
+      uint32_t now = millis();
+      if(!_count){
+        _elapsed = 0;
+        _lastMillis = now;
+      }
+      //ticks are counted from the last one processed, include the time that has passed since
+      uint32_t ticks = (_elapsed + (now - _lastMillis) + ms + ASYNC_TIMER_WHEEL_RESOLUTION - 1) / ASYNC_TIMER_WHEEL_RESOLUTION;
+      t->_tick = _tick + (ticks ? ticks : 1);
+      t->_wheel = this;
+      _link(t, t->_tick % ASYNC_TIMER_WHEEL_SLOTS);
+      _count++;
+    }
+
+    void cancel(AsyncTimer *t){
+      if(t->_wheel != this)
+        return;
+      _unlink(t);
+      t->_wheel = NULL;
+      _count--;
+    }
+
+    //fires the timers that are due, handlers may schedule and cancel timers
+    void advance(uint32_t now){
+      if(!_count){
+        _elapsed = 0;
+        _lastMillis = now;
+        return;
+      }
+      _elapsed += now - _lastMillis;
+      _lastMillis = now;
+      if(_elapsed < ASYNC_TIMER_WHEEL_RESOLUTION)
+        return;
+      uint32_t steps = _elapsed / ASYNC_TIMER_WHEEL_RESOLUTION;
+      _elapsed %= ASYNC_TIMER_WHEEL_RESOLUTION;
+      //after a long pause one round visits every slot
+      if(steps > ASYNC_TIMER_WHEEL_SLOTS){
+        _tick += steps - ASYNC_TIMER_WHEEL_SLOTS;
+        steps = ASYNC_TIMER_WHEEL_SLOTS;
+      }
+      while(steps--){
+        _tick++;
+        uint8_t slot = _tick % ASYNC_TIMER_WHEEL_SLOTS;
+        AsyncTimer *t;
+        while((t = _slots[slot]) != NULL){
+          _unlink(t);
+          _link(t, ASYNC_TIMER_WHEEL_SLOTS);
+        }
+        while((t = _slots[ASYNC_TIMER_WHEEL_SLOTS]) != NULL){
+          _unlink(t);
+          if((int32_t)(t->_tick - _tick) > 0){
+            _link(t, slot);
+            continue;
+          }
+          t->_wheel = NULL;
+          _count--;
+          if(t->_handler)
+            t->_handler();
+        }
+      }
+    }
+};
+
+AsyncTimer::~AsyncTimer(){
+  if(_wheel)
+    _wheel->cancel(this);
+}
+
+#endif /* ASYNCTIMERWHEEL_H_ */
@@ -20,27 +20,75 @@
 */
 #include "Arduino.h"
 #include "AsyncWebSocket.h"
+#include "WebSocketDeflate.h"
 
-#include <libb64/cencode.h>
 
-#ifndef ESP8266
-extern "C" {
-typedef struct {
-    uint32_t state[5];
-    uint32_t count[2];
-    unsigned char buffer[64];
-} SHA1_CTX;
-
-void SHA1Transform(uint32_t state[5], const unsigned char buffer[64]);
-void SHA1Init(SHA1_CTX* context);
-void SHA1Update(SHA1_CTX* context, const unsigned char* data, uint32_t len);
-void SHA1Final(unsigned char digest[20], SHA1_CTX* context);
-}
-#else
-#include <Hash.h>
+// text that formats shorter than this is formatted on the stack
+#ifndef MAX_PRINTF_LEN
+#define MAX_PRINTF_LEN 128
 #endif
 
-#define MAX_PRINTF_LEN 64
+// XORs len bytes with the 4 byte mask, starting at mask position index.
+// The mask is rotated once, the unaligned head is done bytewise and the rest a 32 bit word at a time
+void webSocketMask(uint8_t *data, size_t len, const uint8_t *mask, size_t index){
+  uint8_t m[4];
+  for(uint8_t i=0;i<4;i++)
+    m[i] = mask[(index + i) & 3];
+  while(len && ((uintptr_t)data & 3)){
+    *data++ ^= m[0];
+    uint8_t t = m[0];
+    m[0] = m[1];
+    m[1] = m[2];
+    m[2] = m[3];
+    m[3] = t;
+    len--;
+  }
+  uint32_t m32;
+  memcpy(&m32, m, 4);
+  uint32_t *w = (uint32_t*)data;
+  while(len >= 16){
+    w[0] ^= m32;
+    w[1] ^= m32;
+    w[2] ^= m32;
+    w[3] ^= m32;
+    w += 4;
+    len -= 16;
+  }
+  while(len >= 4){
+    *w++ ^= m32;
+    len -= 4;
+  }
+  data = (uint8_t*)w;
+  for(uint8_t i=0;i<len;i++)
+    data[i] ^= m[i];
+}
+
+// length of the unmasked header of a frame with len payload bytes
+static inline uint8_t webSocketFrameHeaderSize(size_t len){
+  return (len < 126)?2:((len < 65536)?4:10);
+}
+
+// writes an unmasked header for a frame of len bytes into buf (10 bytes at most) and returns its length
+uint8_t webSocketFrameHeader(uint8_t *buf, bool final, uint8_t opcode, size_t len){
+  buf[0] = opcode & (WS_COMPRESSED | 0x0F);
+  if(final)
+    buf[0] |= 0x80;
+  if(len < 126){
+    buf[1] = len & 0x7F;
+    return 2;
+  }
+  if(len < 65536){
+    buf[1] = 126;
+    buf[2] = (uint8_t)((len >> 8) & 0xFF);
+    buf[3] = (uint8_t)(len & 0xFF);
+    return 4;
+  }
+  buf[1] = 127;
+  uint64_t l = len;
+  for(uint8_t i = 0; i < 8; i++)
+    buf[9 - i] = (uint8_t)((l >> (8 * i)) & 0xFF);
+  return 10;
+}
 
 size_t webSocketSendFrameWindow(AsyncClient *client){
   if(!client->canSend())
@@ -48,75 +96,53 @@ size_t webSocketSendFrameWindow(AsyncClient *client){
   size_t space = client->space();
   if(space < 9)
     return 0;
-  return space - 8;
+  //room for the header and mask, a 64 bit length needs more
+  size_t window = space - 8;
+  return (window < 65536)?window:(space - 14);
 }
 
+// Adds one whole frame to the client without sending it, the caller flushes all queued frames with a single send().
+// Returns the bytes added, header included, 0 if the frame does not fit
 size_t webSocketSendFrame(AsyncClient *client, bool final, uint8_t opcode, bool mask, uint8_t *data, size_t len){
   if(!client->canSend())
     return 0;
-  size_t space = client->space();
-  if(space < 2)
+  uint8_t maskLen = (len && mask)?4:0;
+  uint8_t headLen = webSocketFrameHeaderSize(len) + maskLen;
+  if(client->space() < headLen + len)
     return 0;
-  uint8_t mbuf[4] = {0,0,0,0};
-  uint8_t headLen = 2;
-  if(len && mask){
-    headLen += 4;
+
+  // header is built on the stack and small frames are added together with their payload
+  uint8_t buf[14 + WS_COALESCE_FRAME_SIZE];
+  webSocketFrameHeader(buf, final, opcode, len);
+  if(maskLen){
+    uint8_t *mbuf = buf + (headLen - 4);
+    buf[1] |= 0x80;
     mbuf[0] = rand() % 0xFF;
     mbuf[1] = rand() % 0xFF;
     mbuf[2] = rand() % 0xFF;
     mbuf[3] = rand() % 0xFF;
+    webSocketMask(data, len, mbuf, 0);
   }
-  if(len > 125)
-    headLen += 2;
-  if(space < headLen)
-    return 0;
-  space -= headLen;
-
-  if(len > space) len = space;
 
-  uint8_t *buf = (uint8_t*)malloc(headLen);
-  if(buf == NULL){
-    //os_printf("could not malloc %u bytes for frame header\n", headLen);
-    return 0;
+  if(len <= WS_COALESCE_FRAME_SIZE){
+    if(len)
+      memcpy(buf + headLen, data, len);
+    if(client->add((const char *)buf, headLen + len) != headLen + len){
+      //os_printf("error adding %lu frame bytes\n", headLen + len);
+      return 0;
+    }
+    return headLen + len;
   }
 
-  buf[0] = opcode & 0x0F;
-  if(final)
-    buf[0] |= 0x80;
-  if(len < 126)
-    buf[1] = len & 0x7F;
-  else {
-    buf[1] = 126;
-    buf[2] = (uint8_t)((len >> 8) & 0xFF);
-    buf[3] = (uint8_t)(len & 0xFF);
-  }
-  if(len && mask){
-    buf[1] |= 0x80;
-    memcpy(buf + (headLen - 4), mbuf, 4);
-  }
   if(client->add((const char *)buf, headLen) != headLen){
     //os_printf("error adding %lu header bytes\n", headLen);
-    free(buf);
     return 0;
   }
-  free(buf);
-
-  if(len){
-    if(len && mask){
-      size_t i;
-      for(i=0;i<len;i++)
-        data[i] = data[i] ^ mbuf[i%4];
-    }
-    if(client->add((const char *)data, len) != len){
-      //os_printf("error adding %lu data bytes\n", len);
-      return 0;
-    }
-  }
-  if(!client->send()){
-    //os_printf("error sending frame: %lu\n", headLen+len);
+  if(client->add((const char *)data, len) != len){
+    //os_printf("error adding %lu data bytes\n", len);
     return 0;
   }
-  return len;
+  return headLen + len;
 }
 
 
@@ -131,6 +157,13 @@ AsyncWebSocketMessageBuffer::AsyncWebSocketMessageBuffer()
   ,_len(0)
   ,_lock(false)
   ,_count(0)
+  ,_tag(0)
+  ,_deflated(nullptr)
+  ,_deflatedLen(0)
+  ,_deflateBits(0)
+  ,_frameOpcode(0)
+  ,_frameHead(0)
+  ,_deflatedHead(0)
 {
 
 }
@@ -140,13 +173,20 @@ AsyncWebSocketMessageBuffer::AsyncWebSocketMessageBuffer(uint8_t * data, size_t
   ,_len(size)
   ,_lock(false)
   ,_count(0)
+  ,_tag(0)
+  ,_deflated(nullptr)
+  ,_deflatedLen(0)
+  ,_deflateBits(0)
+  ,_frameOpcode(0)
+  ,_frameHead(0)
+  ,_deflatedHead(0)
 {
 
   if (!data) {
     return; 
   }
 
-  _data = new uint8_t[_len + 1];
+  _data = _allocate(_len);
 
   if (_data) {
     memcpy(_data, data, _len);
@@ -160,8 +200,15 @@ AsyncWebSocketMessageBuffer::AsyncWebSocketMessageBuffer(size_t size)
   ,_len(size)
   ,_lock(false)
   ,_count(0)
+  ,_tag(0)
+  ,_deflated(nullptr)
+  ,_deflatedLen(0)
+  ,_deflateBits(0)
+  ,_frameOpcode(0)
+  ,_frameHead(0)
+  ,_deflatedHead(0)
 {
-  _data = new uint8_t[_len + 1]; 
+  _data = _allocate(_len); 
 
   if (_data) {
     _data[_len] = 0; 
@@ -174,13 +221,21 @@ AsyncWebSocketMessageBuffer::AsyncWebSocketMessageBuffer(const AsyncWebSocketMes
   ,_len(0)
   ,_lock(false)
   ,_count(0)
+  ,_tag(0)
+  ,_deflated(nullptr)
+  ,_deflatedLen(0)
+  ,_deflateBits(0)
+  ,_frameOpcode(0)
+  ,_frameHead(0)
+  ,_deflatedHead(0)
 {
   _len = copy._len;
   _lock = copy._lock;
   _count = 0;
+  _tag = copy._tag;
 
   if (_len) {
-    _data = new uint8_t[_len + 1]; 
+    _data = _allocate(_len); 
     _data[_len] = 0; 
   } 
 
@@ -196,35 +251,62 @@ AsyncWebSocketMessageBuffer::AsyncWebSocketMessageBuffer(AsyncWebSocketMessageBu
   ,_len(0)
   ,_lock(false)
   ,_count(0)
+  ,_tag(0)
+  ,_deflated(nullptr)
+  ,_deflatedLen(0)
+  ,_deflateBits(0)
+  ,_frameOpcode(0)
+  ,_frameHead(0)
+  ,_deflatedHead(0)
 {
   _len = copy._len;
   _lock = copy._lock;
   _count = 0;
+  _tag = copy._tag;
 
   if (copy._data) {
     _data = copy._data; 
     copy._data = nullptr; 
   } 
 
+  _deflated = copy._deflated;
+  _deflatedLen = copy._deflatedLen;
+  _deflateBits = copy._deflateBits;
+  _frameOpcode = copy._frameOpcode;
+  _frameHead = copy._frameHead;
+  _deflatedHead = copy._deflatedHead;
+  copy._deflated = nullptr;
+
 }
 
 AsyncWebSocketMessageBuffer::~AsyncWebSocketMessageBuffer()
 {
     if (_data) {
-      delete[] _data; 
+      delete[] (_data - WS_FRAME_HEADROOM); 
+    }
+    if (_deflated) {
+      free(_deflated - WS_FRAME_HEADROOM);
     }
 }
 
 bool AsyncWebSocketMessageBuffer::reserve(size_t size) 
 {
   _len = size; 
+  if (_deflated) {
+    free(_deflated - WS_FRAME_HEADROOM);
+  }
+  _deflated = nullptr;
+  _deflateBits = 0;
+  _frameOpcode = 0;
+  _frameHead = 0;
+  _deflatedHead = 0;
 
   if (_data) {
-    delete[] _data;
+    delete[] (_data - WS_FRAME_HEADROOM);
     _data = nullptr; 
   }
 
-  _data = new uint8_t[_len + 1];
+  _data = _allocate(_len);
 
   if (_data) {
     _data[_len] = 0;
@@ -236,6 +318,49 @@ bool AsyncWebSocketMessageBuffer::reserve(size_t size)
 }
 
 
+bool AsyncWebSocketMessageBuffer::deflate(uint8_t windowBits)
+{
+  // compressed on first use, clients that negotiated a smaller window get the plain data
+  if (!_deflateBits) {
+    _deflateBits = windowBits;
+    if (_data && _len >= WS_DEFLATE_MIN_SIZE) {
+      uint8_t * deflated = webSocketDeflate(_data, _len, windowBits, &_deflatedLen);
+      // moved behind the same headroom as the plain payload
+      uint8_t * raw = deflated ? (uint8_t*)realloc(deflated, WS_FRAME_HEADROOM + _deflatedLen) : nullptr;
+      if (raw) {
+        memmove(raw + WS_FRAME_HEADROOM, raw, _deflatedLen);
+        _deflated = raw + WS_FRAME_HEADROOM;
+      } else {
+        free(deflated);
+      }
+    }
+  }
+  return _deflated && _deflateBits <= windowBits;
+}
+
+uint8_t * AsyncWebSocketMessageBuffer::_allocate(size_t len)
+{
+  uint8_t * raw = new uint8_t[WS_FRAME_HEADROOM + len + 1];
+  return raw ? raw + WS_FRAME_HEADROOM : nullptr;
+}
+
+uint8_t * AsyncWebSocketMessageBuffer::frame(uint8_t opcode, bool deflated, size_t * len)
+{
+  // the header is written once into the headroom, every client then sends the same bytes
+  uint8_t * payload = deflated ? _deflated : _data;
+  size_t payloadLen = deflated ? _deflatedLen : _len;
+  uint8_t & head = deflated ? _deflatedHead : _frameHead;
+  if (!payload || (_frameOpcode && _frameOpcode != opcode)) {
+    return nullptr;
+  }
+  _frameOpcode = opcode;
+  if (!head) {
+    head = webSocketFrameHeader(payload - WS_FRAME_HEADROOM, true, opcode | (deflated ? WS_COMPRESSED : 0), payloadLen);
+    memmove(payload - head, payload - WS_FRAME_HEADROOM, head);
+  }
+  *len = head + payloadLen;
+  return payload - head;
+}
 
 /*
  * Control Frame
@@ -247,13 +372,13 @@ class AsyncWebSocketControl {
     uint8_t *_data;
     size_t _len;
     bool _mask;
-    bool _finished;
+    bool _shared;
   public:
     AsyncWebSocketControl(uint8_t opcode, uint8_t *data=NULL, size_t len=0, bool mask=false)
       :_opcode(opcode)
       ,_len(len)
       ,_mask(len && mask)
-      ,_finished(false)
+      ,_shared(false)
   {
       if(data == NULL)
         _len = 0;
@@ -266,15 +391,22 @@ class AsyncWebSocketControl {
         else memcpy(_data, data, len);
       } else _data = NULL;
     }
+    //sends a constant payload without copying it, such as the keepalive ping all clients share
+    AsyncWebSocketControl(uint8_t opcode, const char *payload, size_t len)
+      :_opcode(opcode)
+      ,_data((uint8_t *)payload)
+      ,_len(len > 125 ? 125 : len)
+      ,_mask(false)
+      ,_shared(true)
+    {}
     virtual ~AsyncWebSocketControl(){
-      if(_data != NULL)
+      if(_data != NULL && !_shared)
         free(_data);
     }
-    virtual bool finished() const { return _finished; }
     uint8_t opcode(){ return _opcode; }
-    uint8_t len(){ return _len + 2; }
+    uint8_t len(){ return _len + 2 + (_mask ? 4 : 0); }
+    //bytes added to the client, 0 if the frame did not fit
     size_t send(AsyncClient *client){
-      _finished = true;
       return webSocketSendFrame(client, true, _opcode & 0x0F, _mask, _data, _len);
     }
 };
@@ -290,7 +422,7 @@ AsyncWebSocketBasicMessage::AsyncWebSocketBasicMessage(const char * data, size_t
   ,_ack(0)
   ,_acked(0)
 {
-  _opcode = opcode & 0x07;
+  _opcode = opcode & (WS_COMPRESSED | 0x07);
   _mask = mask;
   _data = (uint8_t*)malloc(_len+1);
   if(_data == NULL){
@@ -320,6 +452,20 @@ AsyncWebSocketBasicMessage::~AsyncWebSocketBasicMessage() {
     free(_data);
 }
 
+bool AsyncWebSocketBasicMessage::deflate(uint8_t windowBits){
+  if(_status != WS_MSG_SENDING || _ack || _len < WS_DEFLATE_MIN_SIZE)
+    return false;
+  size_t len;
+  uint8_t *data = webSocketDeflate(_data, _len, windowBits, &len);
+  if(data == NULL)
+    return false;
+  free(_data);
+  _data = data;
+  _len = len;
+  _opcode |= WS_COMPRESSED;
+  return true;
+}
+
  void AsyncWebSocketBasicMessage::ack(size_t len, uint32_t time)  {
   _acked += len;
   if(_sent == _len && _acked == _ack){
@@ -329,10 +475,7 @@ AsyncWebSocketBasicMessage::~AsyncWebSocketBasicMessage() {
  size_t AsyncWebSocketBasicMessage::send(AsyncClient *client)  {
   if(_status != WS_MSG_SENDING)
     return 0;
-  if(_acked < _ack){
-    return 0;
-  }
-  if(_sent == _len){
+  if(_sent == _len && _ack){
     if(_acked == _ack)
       _status = WS_MSG_SENT;
     return 0;
@@ -349,20 +492,17 @@ AsyncWebSocketBasicMessage::~AsyncWebSocketBasicMessage() {
       toSend = window;
   }
 
-  _sent += toSend;
-  _ack += toSend + ((toSend < 126)?2:4) + (_mask * 4);
+  bool final = (_sent + toSend == _len);
+  uint8_t* dPtr = (uint8_t*)(_data + _sent);
+  uint8_t opCode = _sent?(uint8_t)WS_CONTINUATION:_opcode;
 
-  bool final = (_sent == _len);
-  uint8_t* dPtr = (uint8_t*)(_data + (_sent - toSend));
-  uint8_t opCode = (toSend && _sent == toSend)?_opcode:(uint8_t)WS_CONTINUATION;
-
-  size_t sent = webSocketSendFrame(client, final, opCode, _mask, dPtr, toSend);
-  _status = WS_MSG_SENDING;
-  if(toSend && sent != toSend){
-      _sent -= (toSend - sent);
-      _ack -= (toSend - sent);
+  //frames go out as long as the window allows, the client keeps track of what is acked
+  size_t added = webSocketSendFrame(client, final, opCode, _mask, dPtr, toSend);
+  if(added){
+    _sent += toSend;
+    _ack += added;
   }
-  return sent;
+  return added;
 }
 
 // bool AsyncWebSocketBasicMessage::reserve(size_t size) { 
@@ -384,12 +524,13 @@ AsyncWebSocketBasicMessage::~AsyncWebSocketBasicMessage() {
  */
 
 
-AsyncWebSocketMultiMessage::AsyncWebSocketMultiMessage(AsyncWebSocketMessageBuffer * buffer, uint8_t opcode, bool mask)
+AsyncWebSocketMultiMessage::AsyncWebSocketMultiMessage(AsyncWebSocketMessageBuffer * buffer, uint8_t opcode, bool mask, uint8_t deflate)
   :_len(0)
   ,_sent(0)
   ,_ack(0)
   ,_acked(0)
   ,_WSbuffer(nullptr)
+  ,_frame(false)
 {
 
   _opcode = opcode & 0x07;
@@ -398,8 +539,26 @@ AsyncWebSocketMultiMessage::AsyncWebSocketMultiMessage(AsyncWebSocketMessageBuff
   if (buffer) {
     _WSbuffer = buffer; 
     (*_WSbuffer)++; 
-    _data = buffer->get(); 
-    _len = buffer->length(); 
+    _tag = buffer->tag();
+    bool deflated = deflate && buffer->deflate(deflate);
+    if (deflated) {
+      _data = buffer->deflated();
+      _len = buffer->deflatedLength();
+      _opcode |= WS_COMPRESSED;
+    } else {
+      _data = buffer->get(); 
+      _len = buffer->length(); 
+    }
+    // unmasked messages send the frame the buffer prepared for all clients
+    if (!_mask) {
+      uint8_t * frame = buffer->frame(_opcode & 0x07, deflated, &_len);
+      if (frame) {
+        _data = frame;
+        _frame = true;
+      } else {
+        _len = deflated ? buffer->deflatedLength() : buffer->length();
+      }
+    }
     _status = WS_MSG_SENDING;
     //ets_printf("M: %u\n", _len);
   } else {
@@ -425,10 +584,7 @@ AsyncWebSocketMultiMessage::~AsyncWebSocketMultiMessage() {
  size_t AsyncWebSocketMultiMessage::send(AsyncClient *client)  {
   if(_status != WS_MSG_SENDING)
     return 0;
-  if(_acked < _ack){
-    return 0;
-  }
-  if(_sent == _len){
+  if(_sent == _len && _ack){
     _status = WS_MSG_SENT;
     return 0;
   }
@@ -438,6 +594,24 @@ AsyncWebSocketMultiMessage::~AsyncWebSocketMultiMessage() {
       return 0;
   }
 
+  if(_frame && !_sent && client->space() < _len){
+    //the prepared frame does not fit, fragment the payload so control frames can go in between
+    size_t payloadLen = (_opcode & WS_COMPRESSED) ? _WSbuffer->deflatedLength() : _WSbuffer->length();
+    _data += _len - payloadLen;
+    _len = payloadLen;
+    _frame = false;
+  }
+
+  if(_frame){
+    if(!client->canSend())
+      return 0;
+    size_t toSend = std::min(client->space(), _len - _sent);
+    size_t sent = toSend ? client->add((const char *)(_data + _sent), toSend) : 0;
+    _sent += sent;
+    _ack += sent;
+    return sent;
+  }
+
   size_t toSend = _len - _sent;
   size_t window = webSocketSendFrameWindow(client);
 
@@ -445,24 +619,111 @@ AsyncWebSocketMultiMessage::~AsyncWebSocketMultiMessage() {
       toSend = window;
   }
 
-  _sent += toSend;
-  _ack += toSend + ((toSend < 126)?2:4) + (_mask * 4);
+  //ets_printf("W: %u %u\n", _sent, toSend);
 
-  //ets_printf("W: %u %u\n", _sent - toSend, toSend);
+  bool final = (_sent + toSend == _len);
+  uint8_t* dPtr = (uint8_t*)(_data + _sent);
+  uint8_t opCode = _sent?(uint8_t)WS_CONTINUATION:_opcode;
 
-  bool final = (_sent == _len);
-  uint8_t* dPtr = (uint8_t*)(_data + (_sent - toSend));
-  uint8_t opCode = (toSend && _sent == toSend)?_opcode:(uint8_t)WS_CONTINUATION;
+  size_t added = webSocketSendFrame(client, final, opCode, _mask, dPtr, toSend);
+  if(added){
+    _sent += toSend;
+    _ack += added;
+  }
+  //ets_printf("S: %u %u\n", _sent, added);
+  return added;
+}
+
+/*
+ * AsyncWebSocketStreamMessage Message
+ */
 
-  size_t sent = webSocketSendFrame(client, final, opCode, _mask, dPtr, toSend);
+AsyncWebSocketStreamMessage::AsyncWebSocketStreamMessage(AwsResponseFiller filler, uint8_t opcode)
+  :_filler(filler)
+  ,_total((size_t)-1)
+  ,_index(0)
+  ,_ack(0)
+  ,_acked(0)
+  ,_chunk(NULL)
+  ,_done(false)
+{
+  _opcode = opcode & 0x07;
+  _mask = false;
+  _status = _filler ? WS_MSG_SENDING : WS_MSG_ERROR;
+}
+
+AsyncWebSocketStreamMessage::AsyncWebSocketStreamMessage(File file, uint8_t opcode)
+  :_file(file)
+  ,_total(0)
+  ,_index(0)
+  ,_ack(0)
+  ,_acked(0)
+  ,_chunk(NULL)
+  ,_done(false)
+{
+  _opcode = opcode & 0x07;
+  _mask = false;
+  if(!_file){
+    _status = WS_MSG_ERROR;
+    return;
+  }
+  _total = _file.size();
+  _filler = [this](uint8_t *buf, size_t maxLen, size_t index) -> size_t { return _file.read(buf, maxLen); };
   _status = WS_MSG_SENDING;
-  if(toSend && sent != toSend){
-      //ets_printf("E: %u != %u\n", toSend, sent);
-      _sent -= (toSend - sent);
-      _ack -= (toSend - sent);
+}
+
+AsyncWebSocketStreamMessage::~AsyncWebSocketStreamMessage() {
+  free(_chunk);
+  if(_file)
+    _file.close();
+}
+
+void AsyncWebSocketStreamMessage::ack(size_t len, uint32_t time) {
+  _acked += len;
+  if(_done && _acked >= _ack)
+    _status = WS_MSG_SENT;
+}
+
+size_t AsyncWebSocketStreamMessage::send(AsyncClient *client) {
+  size_t added = 0;
+  // one frame per fill, as many as the window takes
+  while(_status == WS_MSG_SENDING && !_done){
+    size_t window = webSocketSendFrameWindow(client);
+    if(!window)
+      break;
+    size_t toSend = std::min(window, (size_t)WS_STREAM_CHUNK_SIZE);
+    if(_total != (size_t)-1)
+      toSend = std::min(toSend, _total - _index);
+    if(_chunk == NULL){
+      _chunk = (uint8_t*)malloc(WS_STREAM_CHUNK_SIZE);
+      if(_chunk == NULL)
+        break;
+    }
+    size_t len = toSend ? _filler(_chunk, toSend, _index) : 0;
+    if(len == RESPONSE_TRY_AGAIN)
+      break;
+    if(len > toSend)
+      len = toSend;
+    bool final = !len || (_total != (size_t)-1 && _index + len == _total);
+    uint8_t opCode = _ack ? (uint8_t)WS_CONTINUATION : _opcode;
+    size_t frameLen = webSocketSendFrame(client, final, opCode, false, _chunk, len);
+    if(!frameLen){
+      //the filler has moved on, the rest of the message cannot follow
+      _status = WS_MSG_ERROR;
+      break;
+    }
+    _index += len;
+    _ack += frameLen;
+    added += frameLen;
+    if(final){
+      _done = true;
+      free(_chunk);
+      _chunk = NULL;
+      if(_file)
+        _file.close();
+    }
   }
-  //ets_printf("S: %u %u\n", _sent, sent);
-  return sent;
+  return added;
 }
 
 
@@ -472,9 +733,15 @@ AsyncWebSocketMultiMessage::~AsyncWebSocketMultiMessage() {
  const char * AWSC_PING_PAYLOAD = "ESPAsyncWebServer-PING";
  const size_t AWSC_PING_PAYLOAD_LEN = 22;
 
-AsyncWebSocketClient::AsyncWebSocketClient(AsyncWebServerRequest *request, AsyncWebSocket *server)
+AsyncWebSocketClient::AsyncWebSocketClient(AsyncWebServerRequest *request, AsyncWebSocket *server, uint8_t deflate, const String& protocol)
   : _controlQueue(LinkedList<AsyncWebSocketControl *>([](AsyncWebSocketControl *c){ delete  c; }))
-  , _messageQueue(LinkedList<AsyncWebSocketMessage *>([](AsyncWebSocketMessage *m){ delete  m; }))
+  , _messageQueue(server->maxQueuedMessages(), [](AsyncWebSocketMessage *m){ delete  m; })
+  , _queueHighWatermark(0)
+  , _queued(0)
+  , _dropped(0)
+  , _coalesced(0)
+  , _backpressure(server->backpressure())
+  , _keepAliveTimer([this](){ _onKeepAlive(); })
   , _tempObject(NULL)
 {
   _client = request->client();
@@ -482,8 +749,18 @@ AsyncWebSocketClient::AsyncWebSocketClient(AsyncWebServerRequest *request, Async
   _clientId = _server->_getNextId();
   _status = WS_CONNECTED;
   _pstate = 0;
+  _pheaderLen = 0;
+  _pcontrol = NULL;
+  _pfragmented = false;
+  _pcompressed = false;
+  _pmessage = NULL;
+  _pmessageLen = 0;
+  _pmessageSize = 0;
+  memset(&_pinfo, 0, sizeof(_pinfo));
   _lastMessageTime = millis();
-  _keepAlivePeriod = 0;
+  _deflate = deflate;
+  _protocol = protocol;
+  keepAlivePeriod(_server->keepAlivePeriod(), _server->pongTimeout());
   _client->setRxTimeout(0);
   _client->onError([](void *r, AsyncClient* c, int8_t error){ ((AsyncWebSocketClient*)(r))->_onError(error); }, this);
   _client->onAck([](void *r, AsyncClient* c, size_t len, uint32_t time){ ((AsyncWebSocketClient*)(r))->_onAck(len, time); }, this);
@@ -497,58 +774,184 @@ AsyncWebSocketClient::AsyncWebSocketClient(AsyncWebServerRequest *request, Async
 }
 
 AsyncWebSocketClient::~AsyncWebSocketClient(){
+  _inFlight.clear();
   _messageQueue.free();
   _controlQueue.free();
+  free(_pcontrol);
+  free(_pmessage);
   _server->_handleEvent(this, WS_EVT_DISCONNECT, NULL, NULL, 0);
 }
 
 void AsyncWebSocketClient::_onAck(size_t len, uint32_t time){
   _lastMessageTime = millis();
-  if(!_controlQueue.isEmpty()){
-    auto head = _controlQueue.front();
-    if(head->finished()){
-      len -= head->len();
-      if(_status == WS_DISCONNECTING && head->opcode() == WS_DISCONNECT){
-        _controlQueue.remove(head);
-        _status = WS_DISCONNECTED;
-        _client->close(true);
-        return;
-      }
-      _controlQueue.remove(head);
+  //acks come in the order the frames were added, hand them to their owners
+  while(len && !_inFlight.empty()){
+    AwsInFlight &f = _inFlight.front();
+    size_t n = std::min(len, f.len);
+    len -= n;
+    f.len -= n;
+    if(f.message)
+      f.message->ack(n, time);
+    if(f.len)
+      break;
+    uint8_t opcode = f.opcode;
+    _inFlight.erase(_inFlight.begin());
+    if(_status == WS_DISCONNECTING && opcode == WS_DISCONNECT){
+      _status = WS_DISCONNECTED;
+      _client->close(true);
+      return;
     }
   }
-  if(len && !_messageQueue.isEmpty()){
-    _messageQueue.front()->ack(len, time);
-  }
-  _server->_cleanBuffers(); 
   _runQueue();
 }
 
 void AsyncWebSocketClient::_onPoll(){
   if(_client->canSend() && (!_controlQueue.isEmpty() || !_messageQueue.isEmpty())){
     _runQueue();
-  } else if(_keepAlivePeriod > 0 && _controlQueue.isEmpty() && _messageQueue.isEmpty() && (millis() - _lastMessageTime) >= _keepAlivePeriod){
-    ping((uint8_t *)AWSC_PING_PAYLOAD, AWSC_PING_PAYLOAD_LEN);
+  }
+  //keepalive of all clients, this one included, so nothing may follow
+  _server->_timers().advance(millis());
+}
+
+void AsyncWebSocketClient::keepAlivePeriod(uint16_t seconds, uint16_t pongTimeout){
+  _keepAlivePeriod = seconds * 1000;
+  _pongTimeout = pongTimeout * 1000;
+  _awaitingPong = false;
+  if(_keepAlivePeriod)
+    _server->_timers().schedule(&_keepAliveTimer, _keepAlivePeriod);
+  else
+    _server->_timers().cancel(&_keepAliveTimer);
+}
+
+void AsyncWebSocketClient::_onKeepAlive(){
+  if(_status != WS_CONNECTED)
+    return;
+  if(_awaitingPong){
+    //nothing came back since the ping, the peer is gone
+    _client->close(true);
+    return;
+  }
+  //traffic since the timer was set only moves the deadline, pings go to idle clients
+  uint32_t idle = millis() - _lastMessageTime;
+  if(idle < _keepAlivePeriod){
+    _server->_timers().schedule(&_keepAliveTimer, _keepAlivePeriod - idle);
+    return;
+  }
+  if(!_controlQueue.isEmpty() || !_messageQueue.isEmpty()){
+    _server->_timers().schedule(&_keepAliveTimer, _keepAlivePeriod);
+    return;
+  }
+  _queueControl(new AsyncWebSocketControl(WS_PING, AWSC_PING_PAYLOAD, AWSC_PING_PAYLOAD_LEN));
+  _awaitingPong = _pongTimeout > 0;
+  _server->_timers().schedule(&_keepAliveTimer, _awaitingPong ? _pongTimeout : _keepAlivePeriod);
+}
+
+void AsyncWebSocketClient::_addInFlight(AsyncWebSocketMessage *message, uint8_t opcode, size_t len){
+  if(!len)
+    return;
+  if(message && !_inFlight.empty() && _inFlight.back().message == message){
+    _inFlight.back().len += len;
+    return;
+  }
+  AwsInFlight f;
+  f.message = message;
+  f.len = len;
+  f.opcode = opcode;
+  _inFlight.push_back(f);
+}
+
+//bytes of a message that is deleted are still acked, they are only counted from now on
+void AsyncWebSocketClient::_forgetInFlight(AsyncWebSocketMessage *message){
+  for(auto& f: _inFlight){
+    if(f.message == message)
+      f.message = NULL;
   }
 }
 
 void AsyncWebSocketClient::_runQueue(){
+  bool removed = false;
   while(!_messageQueue.isEmpty() && _messageQueue.front()->finished()){
-    _messageQueue.remove(_messageQueue.front());
+    //a message that failed can still have bytes in flight
+    _forgetInFlight(_messageQueue.front());
+    _messageQueue.pop_front();
+    removed = true;
+  }
+  //shared buffers can only be released once a message is done with them
+  if(removed)
+    _server->_cleanBuffers();
+
+  // control frames take the next frame boundary, they only wait for a frame that is partly added
+  bool queued = false;
+  AsyncWebSocketMessage *current = NULL;
+  for(const auto& m: _messageQueue){
+    if(!m->finished() && !m->sent()){
+      current = m;
+      break;
+    }
+  }
+  if(current == NULL || current->betweenFrames()){
+    while(!_controlQueue.isEmpty()){
+      AsyncWebSocketControl *c = _controlQueue.front();
+      size_t added = (webSocketSendFrameWindow(_client) >= c->len()) ? c->send(_client) : 0;
+      if(!added)
+        break;
+      _addInFlight(NULL, c->opcode(), added);
+      _controlQueue.remove(c);
+      queued = true;
+    }
   }
 
-  if(!_controlQueue.isEmpty() && (_messageQueue.isEmpty() || _messageQueue.front()->betweenFrames()) && webSocketSendFrameWindow(_client) > (size_t)(_controlQueue.front()->len() - 1)){
-    _controlQueue.front()->send(_client);
-  } else if(!_messageQueue.isEmpty() && _messageQueue.front()->betweenFrames() && webSocketSendFrameWindow(_client)){
-    _messageQueue.front()->send(_client);
+  // batch as many complete messages as the window takes into one send,
+  // while a control frame waits only a frame that is already started may go on
+  bool controlPending = !_controlQueue.isEmpty();
+  for(const auto& m: _messageQueue){
+    if(m->finished() || m->sent())
+      continue;
+    if((controlPending && m->betweenFrames()) || !webSocketSendFrameWindow(_client))
+      break;
+    size_t added = m->send(_client);
+    _addInFlight(m, 0, added);
+    queued = queued || added;
+    if(!m->sent())
+      break;
   }
+
+  if(queued)
+    _client->send();
+}
+
+AwsQueueStats AsyncWebSocketClient::queueStats() const {
+  AwsQueueStats stats;
+  stats.length = _messageQueue.length();
+  stats.capacity = _messageQueue.capacity();
+  stats.highWatermark = _queueHighWatermark;
+  stats.queued = _queued;
+  stats.dropped = _dropped;
+  stats.coalesced = _coalesced;
+  return stats;
 }
 
 bool AsyncWebSocketClient::queueIsFull(){
-  if((_messageQueue.length() >= WS_MAX_QUEUED_MESSAGES) || (_status != WS_CONNECTED) ) return true;
+  if(_messageQueue.isFull() || (_status != WS_CONNECTED) ) return true;
   return false;
 }
 
+//drops messages nothing of which has been sent yet, the oldest first, returns how many
+size_t AsyncWebSocketClient::_dropUnsent(size_t count){
+  size_t dropped = 0;
+  for(size_t i = 0; i < _messageQueue.length() && dropped < count;){
+    if(_messageQueue[i]->unsent()){
+      _forgetInFlight(_messageQueue[i]);
+      _messageQueue.remove_at(i);
+      dropped++;
+    } else {
+      i++;
+    }
+  }
+  _dropped += dropped;
+  return dropped;
+}
+
 void AsyncWebSocketClient::_queueMessage(AsyncWebSocketMessage *dataMessage){
   if(dataMessage == NULL)
     return;
@@ -556,11 +959,41 @@ void AsyncWebSocketClient::_queueMessage(AsyncWebSocketMessage *dataMessage){
     delete dataMessage;
     return;
   }
-  if(_messageQueue.length() >= WS_MAX_QUEUED_MESSAGES){
-      ets_printf("ERROR: Too many messages queued\n");
+  if(_backpressure == WS_QUEUE_COALESCE && dataMessage->tag()){
+    //latest value wins, it takes the place of a queued message with the same tag
+    for(size_t i = 0; i < _messageQueue.length(); i++){
+      AsyncWebSocketMessage *m = _messageQueue[i];
+      if(m->tag() == dataMessage->tag() && m->unsent()){
+        _messageQueue[i] = dataMessage;
+        _forgetInFlight(m);
+        delete m;
+        _coalesced++;
+        return;
+      }
+    }
+  }
+  if(_messageQueue.isFull()){
+    if(_backpressure == WS_QUEUE_DISCONNECT){
+      //drop what has not been sent so the close frame follows the message in progress
+      DEBUGF("ERROR: Too many messages queued, disconnecting\n");
+      _dropUnsent(_messageQueue.length());
+      _dropped++;
+      delete dataMessage;
+      close(1008);
+      _status = WS_DISCONNECTING;
+      return;
+    }
+    if(_backpressure == WS_QUEUE_DROP_OLDEST)
+      _dropUnsent(1);
+  }
+  if(!_messageQueue.add(dataMessage)){
+      DEBUGF("ERROR: Too many messages queued\n");
+      _dropped++;
       delete dataMessage;
   } else {
-      _messageQueue.add(dataMessage);
+      _queued++;
+      if(_messageQueue.length() > _queueHighWatermark)
+        _queueHighWatermark = _messageQueue.length();
   }
   if(_client->canSend())
     _runQueue();
@@ -599,6 +1032,14 @@ void AsyncWebSocketClient::close(uint16_t code, const char * message){
   _queueControl(new AsyncWebSocketControl(WS_DISCONNECT));
 }
 
+bool AsyncWebSocketClient::subscribe(const String& topic){
+  return _server->subscribe(_clientId, topic);
+}
+
+bool AsyncWebSocketClient::unsubscribe(const String& topic){
+  return _server->unsubscribe(_clientId, topic);
+}
+
 void AsyncWebSocketClient::ping(uint8_t *data, size_t len){
   if(_status == WS_CONNECTED)
     _queueControl(new AsyncWebSocketControl(WS_PING, data, len));
@@ -615,85 +1056,140 @@ void AsyncWebSocketClient::_onDisconnect(){
   _server->_handleDisconnect(this);
 }
 
+// length of the frame header given the bytes of it received so far
+static size_t webSocketHeaderLength(const uint8_t *head, size_t len){
+  if(len < 2)
+    return 2;
+  size_t headLen = 2;
+  if((head[1] & 0x7F) == 126)
+    headLen += 2;
+  else if((head[1] & 0x7F) == 127)
+    headLen += 8;
+  if(head[1] & 0x80)
+    headLen += 4;
+  return headLen;
+}
+
+void AsyncWebSocketClient::_failConnection(uint16_t code){
+  //drop everything the peer sends from now on and close once our close frame is acked
+  _pstate = 2;
+  close(code);
+  _status = WS_DISCONNECTING;
+}
+
 void AsyncWebSocketClient::_onData(void *pbuf, size_t plen){
   _lastMessageTime = millis();
+  _awaitingPong = false;
   uint8_t *data = (uint8_t*)pbuf;
-  while(plen > 0){
+  while(plen > 0 && _pstate != 2){
     if(!_pstate){
-      const uint8_t *fdata = data;
+      //the header can be split across segments, collect it before parsing
+      size_t headLen;
+      while(_pheaderLen < (headLen = webSocketHeaderLength(_pheader, _pheaderLen)) && plen){
+        size_t n = std::min(headLen - _pheaderLen, plen);
+        memcpy(_pheader + _pheaderLen, data, n);
+        _pheaderLen += n;
+        data += n;
+        plen -= n;
+      }
+      if(_pheaderLen < headLen)
+        break;
+
+      const uint8_t *fdata = _pheader;
+      _pheaderLen = 0;
       _pinfo.index = 0;
       _pinfo.final = (fdata[0] & 0x80) != 0;
       _pinfo.opcode = fdata[0] & 0x0F;
       _pinfo.masked = (fdata[1] & 0x80) != 0;
       _pinfo.len = fdata[1] & 0x7F;
-      data += 2;
-      plen -= 2;
+      fdata += 2;
       if(_pinfo.len == 126){
-        _pinfo.len = fdata[3] | (uint16_t)(fdata[2]) << 8;
-        data += 2;
-        plen -= 2;
+        _pinfo.len = fdata[1] | (uint16_t)(fdata[0]) << 8;
+        fdata += 2;
       } else if(_pinfo.len == 127){
-        _pinfo.len = fdata[9] | (uint16_t)(fdata[8]) << 8 | (uint32_t)(fdata[7]) << 16 | (uint32_t)(fdata[6]) << 24 | (uint64_t)(fdata[5]) << 32 | (uint64_t)(fdata[4]) << 40 | (uint64_t)(fdata[3]) << 48 | (uint64_t)(fdata[2]) << 56;
-        data += 8;
-        plen -= 8;
+        _pinfo.len = fdata[7] | (uint16_t)(fdata[6]) << 8 | (uint32_t)(fdata[5]) << 16 | (uint32_t)(fdata[4]) << 24 | (uint64_t)(fdata[3]) << 32 | (uint64_t)(fdata[2]) << 40 | (uint64_t)(fdata[1]) << 48 | (uint64_t)(fdata[0]) << 56;
+        fdata += 8;
+      }
+      if(_pinfo.masked)
+        memcpy(_pinfo.mask, fdata, 4);
+
+      //reserved bits other than RSV1 on the first frame of a deflated message, unknown opcodes and fragmented or long control frames are errors
+      uint8_t rsv = _pheader[0] & 0x70;
+      if((rsv && (rsv != WS_COMPRESSED || !_deflate || _pinfo.opcode == WS_CONTINUATION || _pinfo.opcode >= WS_DISCONNECT))
+        || (_pinfo.opcode > WS_BINARY && _pinfo.opcode < WS_DISCONNECT) || _pinfo.opcode > WS_PONG
+        || (_pinfo.opcode >= WS_DISCONNECT && (!_pinfo.final || _pinfo.len > 125))){
+        _failConnection(1002);
+        break;
       }
 
-      if(_pinfo.masked){
-        memcpy(_pinfo.mask, data, 4);
-        data += 4;
-        plen -= 4;
+      //continuations must follow a fragment and new messages must not interrupt one
+      if(_pinfo.opcode < WS_DISCONNECT && (_pinfo.opcode == WS_CONTINUATION) != _pfragmented){
+        _failConnection(1002);
+        break;
+      }
+      if(_pinfo.opcode == WS_CONTINUATION){
+        _pinfo.num += 1;
+      } else if(_pinfo.opcode < WS_DISCONNECT){
+        _pinfo.message_opcode = _pinfo.opcode;
+        _pinfo.num = 0;
       }
+      if(_pinfo.opcode < WS_DISCONNECT){
+        if(_pinfo.opcode != WS_CONTINUATION)
+          _pcompressed = rsv != 0;
+        _pfragmented = !_pinfo.final;
+        //compressed messages are always collected, they can only be inflated as a whole
+        if((_server->_hasMessageHandler() || _pcompressed) && (_pinfo.opcode != WS_CONTINUATION || _pmessage != NULL) && !_reserveMessage(_pinfo.len))
+          break;
+      }
+      _pstate = 1;
     }
 
     const size_t datalen = std::min((size_t)(_pinfo.len - _pinfo.index), plen);
-    const auto datalast = data[datalen];
 
-    if(_pinfo.masked){
-      for(size_t i=0;i<datalen;i++)
-        data[i] ^= _pinfo.mask[(_pinfo.index+i)%4];
+    if(_pinfo.masked)
+      webSocketMask(data, datalen, _pinfo.mask, _pinfo.index);
+
+    if(_pinfo.opcode >= WS_DISCONNECT){
+      //control payloads are at most 125 bytes, keep the parts of one that is split across segments
+      if(_pcontrol != NULL || datalen < _pinfo.len){
+        if(_pcontrol == NULL)
+          _pcontrol = (uint8_t*)malloc(_pinfo.len);
+        if(_pcontrol == NULL){
+          _failConnection(1011);
+          break;
+        }
+        memcpy(_pcontrol + _pinfo.index, data, datalen);
+      }
+      _pinfo.index += datalen;
+      data += datalen;
+      plen -= datalen;
+      if(_pinfo.index < _pinfo.len)
+        break;
+      _pstate = 0;
+      _handleControl(_pcontrol?_pcontrol:(data - datalen), _pinfo.len);
+      free(_pcontrol);
+      _pcontrol = NULL;
+      continue;
     }
 
-    if((datalen + _pinfo.index) < _pinfo.len){
-      _pstate = 1;
+    const auto datalast = datalen?data[datalen]:0;
 
-      if(_pinfo.index == 0){
-        if(_pinfo.opcode){
-          _pinfo.message_opcode = _pinfo.opcode;
-          _pinfo.num = 0;
-        } else _pinfo.num += 1;
-      }
-      _server->_handleEvent(this, WS_EVT_DATA, (void *)&_pinfo, (uint8_t*)data, datalen);
+    if(_pmessage != NULL)
+      memcpy(_pmessage + _pmessageLen + _pinfo.index, data, datalen);
 
+    if((datalen + _pinfo.index) < _pinfo.len){
+      if(!_pcompressed)
+        _server->_handleEvent(this, WS_EVT_DATA, (void *)&_pinfo, (uint8_t*)data, datalen);
       _pinfo.index += datalen;
-    } else if((datalen + _pinfo.index) == _pinfo.len){
+    } else {
       _pstate = 0;
-      if(_pinfo.opcode == WS_DISCONNECT){
-        if(datalen){
-          uint16_t reasonCode = (uint16_t)(data[0] << 8) + data[1];
-          char * reasonString = (char*)(data+2);
-          if(reasonCode > 1001){
-            _server->_handleEvent(this, WS_EVT_ERROR, (void *)&reasonCode, (uint8_t*)reasonString, strlen(reasonString));
-          }
-        }
-        if(_status == WS_DISCONNECTING){
-          _status = WS_DISCONNECTED;
-          _client->close(true);
-        } else {
-          _status = WS_DISCONNECTING;
-          _queueControl(new AsyncWebSocketControl(WS_DISCONNECT, data, datalen));
-        }
-      } else if(_pinfo.opcode == WS_PING){
-        _queueControl(new AsyncWebSocketControl(WS_PONG, data, datalen));
-      } else if(_pinfo.opcode == WS_PONG){
-        if(datalen != AWSC_PING_PAYLOAD_LEN || memcmp(AWSC_PING_PAYLOAD, data, AWSC_PING_PAYLOAD_LEN) != 0)
-          _server->_handleEvent(this, WS_EVT_PONG, NULL, data, datalen);
-      } else if(_pinfo.opcode < 8){//continuation or text/binary frame
+      if(!_pcompressed)
         _server->_handleEvent(this, WS_EVT_DATA, (void *)&_pinfo, data, datalen);
+      if(_pmessage != NULL){
+        _pmessageLen += _pinfo.len;
+        if(_pinfo.final)
+          _completeMessage();
       }
-    } else {
-      //os_printf("frame error: len: %u, index: %llu, total: %llu\n", datalen, _pinfo.index, _pinfo.len);
-      //what should we do?
-      break;
     }
 
     // restore byte as _handleEvent may have added a null terminator i.e., data[len] = 0;
@@ -705,32 +1201,115 @@ void AsyncWebSocketClient::_onData(void *pbuf, size_t plen){
   }
 }
 
+//makes room for the next len bytes of the message being reassembled
+bool AsyncWebSocketClient::_reserveMessage(uint64_t len){
+  size_t maxLen = _server->maxMessageSize();
+  if(len > maxLen - _pmessageLen){
+    _failConnection(1009);
+    return false;
+  }
+  size_t needed = _pmessageLen + len + 1;
+  if(needed <= _pmessageSize)
+    return true;
+  //the first frame sizes the buffer, continuations grow it at least twofold
+  size_t size = needed;
+  if(_pmessage != NULL)
+    size = std::min(std::max(needed, _pmessageSize * 2), maxLen + 1);
+  uint8_t *buf = (uint8_t*)realloc(_pmessage, size);
+  if(buf == NULL){
+    _failConnection(1009);
+    return false;
+  }
+  _pmessage = buf;
+  _pmessageSize = size;
+  return true;
+}
+
+void AsyncWebSocketClient::_completeMessage(){
+  uint8_t *message = _pmessage;
+  size_t len = _pmessageLen;
+  _pmessage = NULL;
+  _pmessageLen = 0;
+  _pmessageSize = 0;
+  if(_pcompressed){
+    _pcompressed = false;
+    bool tooBig = false;
+    uint8_t *inflated = webSocketInflate(message, len, _server->maxMessageSize(), &len, &tooBig);
+    free(message);
+    if(inflated == NULL){
+      _failConnection(tooBig?1009:1007);
+      return;
+    }
+    message = inflated;
+    //the inflated message is reported as a single frame
+    AwsFrameInfo info = _pinfo;
+    info.opcode = info.message_opcode;
+    info.num = 0;
+    info.index = 0;
+    info.len = len;
+    _server->_handleEvent(this, WS_EVT_DATA, (void *)&info, message, len);
+  }
+  message[len] = 0;
+  _server->_handleMessage(this, _pinfo.message_opcode, message, len);
+  free(message);
+}
+
+AsyncWebSocketMessage * AsyncWebSocketClient::_deflateMessage(AsyncWebSocketBasicMessage *message){
+  if(message != NULL && _deflate)
+    message->deflate(_deflate);
+  return message;
+}
+
+void AsyncWebSocketClient::_handleControl(uint8_t *data, size_t len){
+  if(_pinfo.opcode == WS_DISCONNECT){
+    if(len >= 2){
+      uint16_t reasonCode = (uint16_t)(data[0] << 8) + data[1];
+      char * reasonString = (char*)(data+2);
+      if(reasonCode > 1001){
+        _server->_handleEvent(this, WS_EVT_ERROR, (void *)&reasonCode, (uint8_t*)reasonString, len - 2);
+      }
+    }
+    if(_status == WS_DISCONNECTING){
+      _status = WS_DISCONNECTED;
+      _client->close(true);
+    } else {
+      _status = WS_DISCONNECTING;
+      _queueControl(new AsyncWebSocketControl(WS_DISCONNECT, data, len));
+    }
+  } else if(_pinfo.opcode == WS_PING){
+    _queueControl(new AsyncWebSocketControl(WS_PONG, data, len));
+  } else if(_pinfo.opcode == WS_PONG){
+    if(len != AWSC_PING_PAYLOAD_LEN || memcmp(AWSC_PING_PAYLOAD, data, AWSC_PING_PAYLOAD_LEN) != 0)
+      _server->_handleEvent(this, WS_EVT_PONG, NULL, data, len);
+  }
+}
+
 size_t AsyncWebSocketClient::printf(const char *format, ...) {
   va_list arg;
   va_start(arg, format);
-  char* temp = new char[MAX_PRINTF_LEN];
-  if(!temp){
-    return 0;
-  }
-  char* buffer = temp;
-  size_t len = vsnprintf(temp, MAX_PRINTF_LEN, format, arg);
+  size_t len = vprintf(format, arg);
   va_end(arg);
+  return len;
+}
 
-  if (len > (MAX_PRINTF_LEN - 1)) {
-    buffer = new char[len + 1];
-    if (!buffer) {
-   	  delete[] temp;
-      return 0;
-    }
-    va_start(arg, format);
-    vsnprintf(buffer, len + 1, format, arg);
-    va_end(arg);
-  }
-  text(buffer, len);
-  if (buffer != temp) {
-    delete[] buffer;
+// short text is formatted on the stack, longer text once more straight into a message buffer
+size_t AsyncWebSocketClient::vprintf(const char *format, va_list arg) {
+  char temp[MAX_PRINTF_LEN];
+  va_list copy;
+  va_copy(copy, arg);
+  int len = vsnprintf(temp, MAX_PRINTF_LEN, format, copy);
+  va_end(copy);
+  if(len < 0)
+    return 0;
+  if(len < MAX_PRINTF_LEN){
+    text(temp, len);
+    return len;
   }
-  delete[] temp;
+  AsyncWebSocketMessageBuffer * buffer = _server->makeBuffer(len);
+  if(!buffer || !buffer->get())
+    return 0;
+  vsnprintf((char *)buffer->get(), len + 1, format, arg);
+  text(buffer);
   return len;
 }
 
@@ -738,35 +1317,34 @@ size_t AsyncWebSocketClient::printf(const char *format, ...) {
 size_t AsyncWebSocketClient::printf_P(PGM_P formatP, ...) {
   va_list arg;
   va_start(arg, formatP);
-  char* temp = new char[MAX_PRINTF_LEN];
-  if(!temp){
-    return 0;
-  }
-  char* buffer = temp;
-  size_t len = vsnprintf_P(temp, MAX_PRINTF_LEN, formatP, arg);
+  size_t len = vprintf_P(formatP, arg);
   va_end(arg);
+  return len;
+}
 
-  if (len > (MAX_PRINTF_LEN - 1)) {
-    buffer = new char[len + 1];
-    if (!buffer) {
-   	  delete[] temp;
-      return 0;
-    }
-    va_start(arg, formatP);
-    vsnprintf_P(buffer, len + 1, formatP, arg);
-    va_end(arg);
-  }
-  text(buffer, len);
-  if (buffer != temp) {
-    delete[] buffer;
+size_t AsyncWebSocketClient::vprintf_P(PGM_P formatP, va_list arg) {
+  char temp[MAX_PRINTF_LEN];
+  va_list copy;
+  va_copy(copy, arg);
+  int len = vsnprintf_P(temp, MAX_PRINTF_LEN, formatP, copy);
+  va_end(copy);
+  if(len < 0)
+    return 0;
+  if(len < MAX_PRINTF_LEN){
+    text(temp, len);
+    return len;
   }
-  delete[] temp;
+  AsyncWebSocketMessageBuffer * buffer = _server->makeBuffer(len);
+  if(!buffer || !buffer->get())
+    return 0;
+  vsnprintf_P((char *)buffer->get(), len + 1, formatP, arg);
+  text(buffer);
   return len;
 }
 #endif
 
 void AsyncWebSocketClient::text(const char * message, size_t len){
-  _queueMessage(new AsyncWebSocketBasicMessage(message, len));
+  _queueMessage(_deflateMessage(new AsyncWebSocketBasicMessage(message, len)));
 }
 void AsyncWebSocketClient::text(const char * message){
   text(message, strlen(message));
@@ -798,11 +1376,11 @@ void AsyncWebSocketClient::text(const __FlashStringHelper *data){
 }
 void AsyncWebSocketClient::text(AsyncWebSocketMessageBuffer * buffer)
 {
-  _queueMessage(new AsyncWebSocketMultiMessage(buffer));
+  _queueMessage(new AsyncWebSocketMultiMessage(buffer, WS_TEXT, false, _deflate));
 }
 
 void AsyncWebSocketClient::binary(const char * message, size_t len){
-  _queueMessage(new AsyncWebSocketBasicMessage(message, len, WS_BINARY));
+  _queueMessage(_deflateMessage(new AsyncWebSocketBasicMessage(message, len, WS_BINARY)));
 }
 void AsyncWebSocketClient::binary(const char * message){
   binary(message, strlen(message));
@@ -829,7 +1407,15 @@ void AsyncWebSocketClient::binary(const __FlashStringHelper *data, size_t len){
 }
 void AsyncWebSocketClient::binary(AsyncWebSocketMessageBuffer * buffer)
 {
-  _queueMessage(new AsyncWebSocketMultiMessage(buffer, WS_BINARY));
+  _queueMessage(new AsyncWebSocketMultiMessage(buffer, WS_BINARY, false, _deflate));
+}
+
+void AsyncWebSocketClient::stream(AwsResponseFiller filler, uint8_t opcode){
+  _queueMessage(new AsyncWebSocketStreamMessage(filler, opcode));
+}
+
+void AsyncWebSocketClient::stream(File file, uint8_t opcode){
+  _queueMessage(new AsyncWebSocketStreamMessage(file, opcode));
 }
 
 IPAddress AsyncWebSocketClient::remoteIP() {
@@ -854,8 +1440,13 @@ uint16_t AsyncWebSocketClient::remotePort() {
 
 AsyncWebSocket::AsyncWebSocket(const String& url)
   :_url(url)
-  ,_clients(LinkedList<AsyncWebSocketClient *>([](AsyncWebSocketClient *c){ delete c; }))
   ,_cNextId(1)
+  ,_maxMessageSize(WS_MAX_MESSAGE_SIZE)
+  ,_maxQueuedMessages(WS_MAX_QUEUED_MESSAGES)
+  ,_backpressure(WS_QUEUE_DROP_NEWEST)
+  ,_keepAlivePeriod(0)
+  ,_pongTimeout(0)
+  ,_deflateBits(0)
   ,_enabled(true)
   ,_buffers(LinkedList<AsyncWebSocketMessageBuffer *>([](AsyncWebSocketMessageBuffer *b){ delete b; }))
 {
@@ -870,15 +1461,120 @@ void AsyncWebSocket::_handleEvent(AsyncWebSocketClient * client, AwsEventType ty
   }
 }
 
+void AsyncWebSocket::_handleMessage(AsyncWebSocketClient * client, uint8_t opcode, uint8_t *data, size_t len){
+  if(_messageHandler != NULL){
+    _messageHandler(client, opcode, data, len);
+  }
+}
+
 void AsyncWebSocket::_addClient(AsyncWebSocketClient * client){
-  _clients.add(client);
+  _clientIndex[client->id()] = _clients.size();
+  _clients.push_back(client);
 }
 
 void AsyncWebSocket::_handleDisconnect(AsyncWebSocketClient * client){
-  
-  _clients.remove_first([=](AsyncWebSocketClient * c){
-    return c->id() == client->id();
-  });
+  auto it = _clientIndex.find(client->id());
+  if(it == _clientIndex.end())
+    return;
+  // the last client takes the place of the one that left
+  size_t i = it->second;
+  _clientIndex.erase(it);
+  AsyncWebSocketClient * last = _clients.back();
+  _clients.pop_back();
+  if(last != client){
+    _clients[i] = last;
+    _clientIndex[last->id()] = i;
+  }
+  _unsubscribeAll(client);
+  delete client;
+}
+
+AwsTopic * AsyncWebSocket::_findTopic(const String& topic){
+  for(auto& t: _topics){
+    if(t.name == topic)
+      return &t;
+  }
+  return nullptr;
+}
+
+bool AsyncWebSocket::subscribe(uint32_t id, const String& topic){
+  AsyncWebSocketClient * c = _findClient(id);
+  if(!c || c->status() != WS_CONNECTED)
+    return false;
+  AwsTopic * t = _findTopic(topic);
+  if(!t){
+    _topics.push_back(AwsTopic());
+    t = &_topics.back();
+    t->name = topic;
+  }
+  if(std::find(t->clients.begin(), t->clients.end(), c) == t->clients.end())
+    t->clients.push_back(c);
+  return true;
+}
+
+bool AsyncWebSocket::unsubscribe(uint32_t id, const String& topic){
+  AsyncWebSocketClient * c = _findClient(id);
+  AwsTopic * t = _findTopic(topic);
+  if(!c || !t)
+    return false;
+  auto it = std::find(t->clients.begin(), t->clients.end(), c);
+  if(it == t->clients.end())
+    return false;
+  t->clients.erase(it);
+  if(t->clients.empty())
+    _topics.erase(_topics.begin() + (t - _topics.data()));
+  return true;
+}
+
+void AsyncWebSocket::_unsubscribeAll(AsyncWebSocketClient * client){
+  for(size_t i = _topics.size(); i > 0; i--){
+    std::vector<AsyncWebSocketClient *> &clients = _topics[i - 1].clients;
+    auto it = std::find(clients.begin(), clients.end(), client);
+    if(it == clients.end())
+      continue;
+    clients.erase(it);
+    if(clients.empty())
+      _topics.erase(_topics.begin() + (i - 1));
+  }
+}
+
+size_t AsyncWebSocket::subscribers(const String& topic){
+  AwsTopic * t = _findTopic(topic);
+  return t ? t->clients.size() : 0;
+}
+
+size_t AsyncWebSocket::publish(const String& topic, AsyncWebSocketMessageBuffer * buffer, uint8_t opcode){
+  if (!buffer) return 0;
+  size_t n = 0;
+  buffer->lock();
+  AwsTopic * t = _findTopic(topic);
+  if(t){
+    _deflateBuffer(buffer, t->clients);
+    for(const auto& c: t->clients){
+      if(c->status() == WS_CONNECTED){
+        c->message(new AsyncWebSocketMultiMessage(buffer, opcode, false, c->deflate()));
+        n++;
+      }
+    }
+  }
+  buffer->unlock();
+  _cleanBuffers();
+  return n;
+}
+
+size_t AsyncWebSocket::publish(const String& topic, const char * message, size_t len, uint8_t opcode){
+  if(!_findTopic(topic))
+    return 0;
+  return publish(topic, makeBuffer((uint8_t *)message, len), opcode);
+}
+
+size_t AsyncWebSocket::publish(const String& topic, const String& message){
+  return publish(topic, message.c_str(), message.length());
+}
+
+AsyncWebSocketClient * AsyncWebSocket::_findClient(uint32_t id){
+  auto it = _clientIndex.find(id);
+  return (it == _clientIndex.end()) ? nullptr : _clients[it->second];
 }
 
 bool AsyncWebSocket::availableForWriteAll(){
@@ -889,25 +1585,22 @@ bool AsyncWebSocket::availableForWriteAll(){
 }
 
 bool AsyncWebSocket::availableForWrite(uint32_t id){
-  for(const auto& c: _clients){
-    if(c->queueIsFull() && (c->id() == id )) return false;
-  }
-  return true;
+  AsyncWebSocketClient * c = _findClient(id);
+  return !(c && c->queueIsFull());
 }
 
 size_t AsyncWebSocket::count() const {
-  return _clients.count_if([](AsyncWebSocketClient * c){
-    return c->status() == WS_CONNECTED;
-  });
+  size_t n = 0;
+  for(const auto& c: _clients){
+    if(c->status() == WS_CONNECTED)
+      n++;
+  }
+  return n;
 }
 
 AsyncWebSocketClient * AsyncWebSocket::client(uint32_t id){
-  for(const auto &c: _clients){
-    if(c->id() == id && c->status() == WS_CONNECTED){
-      return c;
-    }
-  }
-  return nullptr;
+  AsyncWebSocketClient * c = _findClient(id);
+  return (c && c->status() == WS_CONNECTED) ? c : nullptr;
 }
 
 
@@ -943,9 +1636,21 @@ void AsyncWebSocket::text(uint32_t id, const char * message, size_t len){
     c->text(message, len);
 }
 
+void AsyncWebSocket::_deflateBuffer(AsyncWebSocketMessageBuffer * buffer, const std::vector<AsyncWebSocketClient *> &clients){
+  // compress once with the smallest window any client negotiated
+  uint8_t bits = 0;
+  for(const auto& c: clients){
+    if(c->status() == WS_CONNECTED && c->deflate() && (!bits || c->deflate() < bits))
+      bits = c->deflate();
+  }
+  if(bits)
+    buffer->deflate(bits);
+}
+
 void AsyncWebSocket::textAll(AsyncWebSocketMessageBuffer * buffer){
   if (!buffer) return;
   buffer->lock(); 
+  _deflateBuffer(buffer, _clients);
   for(const auto& c: _clients){
     if(c->status() == WS_CONNECTED){
         c->text(buffer);
@@ -976,6 +1681,7 @@ void AsyncWebSocket::binaryAll(AsyncWebSocketMessageBuffer * buffer)
 {
   if (!buffer) return;
   buffer->lock(); 
+  _deflateBuffer(buffer, _clients);
     for(const auto& c: _clients){
     if(c->status() == WS_CONNECTED)
       c->binary(buffer);
@@ -1003,7 +1709,7 @@ size_t AsyncWebSocket::printf(uint32_t id, const char *format, ...){
   if(c){
     va_list arg;
     va_start(arg, format);
-    size_t len = c->printf(format, arg);
+    size_t len = c->vprintf(format, arg);
     va_end(arg);
     return len;
   }
@@ -1011,24 +1717,28 @@ size_t AsyncWebSocket::printf(uint32_t id, const char *format, ...){
 }
 
 size_t AsyncWebSocket::printfAll(const char *format, ...) {
+  char temp[MAX_PRINTF_LEN];
   va_list arg;
-  char* temp = new char[MAX_PRINTF_LEN];
-  if(!temp){
-    return 0;
-  }
   va_start(arg, format);
-  size_t len = vsnprintf(temp, MAX_PRINTF_LEN, format, arg);
+  int len = vsnprintf(temp, MAX_PRINTF_LEN, format, arg);
   va_end(arg);
-  delete[] temp;
-  
-  AsyncWebSocketMessageBuffer * buffer = makeBuffer(len); 
-  if (!buffer) {
+  if(len < 0)
     return 0;
-  }
 
-  va_start(arg, format);
-  vsnprintf( (char *)buffer->get(), len + 1, format, arg);
-  va_end(arg);
+  AsyncWebSocketMessageBuffer * buffer;
+  if(len < MAX_PRINTF_LEN){
+    buffer = makeBuffer((uint8_t *)temp, len);
+  } else {
+    buffer = makeBuffer(len);
+    if(buffer && buffer->get()){
+      va_start(arg, format);
+      vsnprintf((char *)buffer->get(), len + 1, format, arg);
+      va_end(arg);
+    }
+  }
+  if (!buffer || !buffer->get()) {
+    return 0;
+  }
 
   textAll(buffer);
   return len;
@@ -1040,7 +1750,7 @@ size_t AsyncWebSocket::printf_P(uint32_t id, PGM_P formatP, ...){
   if(c != NULL){
     va_list arg;
     va_start(arg, formatP);
-    size_t len = c->printf_P(formatP, arg);
+    size_t len = c->vprintf_P(formatP, arg);
     va_end(arg);
     return len;
   }
@@ -1049,24 +1759,28 @@ size_t AsyncWebSocket::printf_P(uint32_t id, PGM_P formatP, ...){
 #endif
 
 size_t AsyncWebSocket::printfAll_P(PGM_P formatP, ...) {
+  char temp[MAX_PRINTF_LEN];
   va_list arg;
-  char* temp = new char[MAX_PRINTF_LEN];
-  if(!temp){
-    return 0;
-  }
   va_start(arg, formatP);
-  size_t len = vsnprintf_P(temp, MAX_PRINTF_LEN, formatP, arg);
+  int len = vsnprintf_P(temp, MAX_PRINTF_LEN, formatP, arg);
   va_end(arg);
-  delete[] temp;
-  
-  AsyncWebSocketMessageBuffer * buffer = makeBuffer(len + 1); 
-  if (!buffer) {
+  if(len < 0)
     return 0;
-  }
 
-  va_start(arg, formatP);
-  vsnprintf_P((char *)buffer->get(), len + 1, formatP, arg);
-  va_end(arg);
+  AsyncWebSocketMessageBuffer * buffer;
+  if(len < MAX_PRINTF_LEN){
+    buffer = makeBuffer((uint8_t *)temp, len);
+  } else {
+    buffer = makeBuffer(len);
+    if(buffer && buffer->get()){
+      va_start(arg, formatP);
+      vsnprintf_P((char *)buffer->get(), len + 1, formatP, arg);
+      va_end(arg);
+    }
+  }
+  if (!buffer || !buffer->get()) {
+    return 0;
+  }
 
   textAll(buffer);
   return len;
@@ -1150,8 +1864,195 @@ const char * WS_STR_VERSION = "Sec-WebSocket-Version";
 const char * WS_STR_KEY = "Sec-WebSocket-Key";
 const char * WS_STR_PROTOCOL = "Sec-WebSocket-Protocol";
 const char * WS_STR_ACCEPT = "Sec-WebSocket-Accept";
+const char * WS_STR_EXTENSIONS = "Sec-WebSocket-Extensions";
+const char * WS_STR_DEFLATE = "permessage-deflate";
 const char * WS_STR_UUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
 
+/*
+ * Accept key: base64(SHA-1(key + WS_STR_UUID)), hashed in place without joining the strings
+ */
+
+typedef struct {
+  uint32_t h[5];
+  uint8_t block[64];
+  uint8_t used;
+  uint32_t total;
+} AwsSha1;
+
+static inline uint32_t _sha1Rol(uint32_t v, uint8_t n){
+  return (v << n) | (v >> (32 - n));
+}
+
+static void _sha1Block(AwsSha1 *s){
+  uint32_t w[16];
+  for(uint8_t i = 0; i < 16; i++)
+    w[i] = ((uint32_t)s->block[i*4] << 24) | ((uint32_t)s->block[i*4+1] << 16) | ((uint32_t)s->block[i*4+2] << 8) | s->block[i*4+3];
+  uint32_t a = s->h[0], b = s->h[1], c = s->h[2], d = s->h[3], e = s->h[4];
+  for(uint8_t i = 0; i < 80; i++){
+    //the message schedule only ever needs the last 16 words
+    if(i >= 16)
+      w[i & 15] = _sha1Rol(w[(i + 13) & 15] ^ w[(i + 8) & 15] ^ w[(i + 2) & 15] ^ w[i & 15], 1);
+    uint32_t f, k;
+    if(i < 20){
+      f = (b & c) | (~b & d);
+      k = 0x5A827999;
+    } else if(i < 40){
+      f = b ^ c ^ d;
+      k = 0x6ED9EBA1;
+    } else if(i < 60){
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8F1BBCDC;
+    } else {
+      f = b ^ c ^ d;
+      k = 0xCA62C1D6;
+    }
+    uint32_t t = _sha1Rol(a, 5) + f + e + k + w[i & 15];
+    e = d;
+    d = c;
+    c = _sha1Rol(b, 30);
+    b = a;
+    a = t;
+  }
+  s->h[0] += a;
+  s->h[1] += b;
+  s->h[2] += c;
+  s->h[3] += d;
+  s->h[4] += e;
+}
+
+static void _sha1Init(AwsSha1 *s){
+  s->h[0] = 0x67452301;
+  s->h[1] = 0xEFCDAB89;
+  s->h[2] = 0x98BADCFE;
+  s->h[3] = 0x10325476;
+  s->h[4] = 0xC3D2E1F0;
+  s->used = 0;
+  s->total = 0;
+}
+
+static void _sha1Update(AwsSha1 *s, const uint8_t *data, size_t len){
+  s->total += len;
+  while(len--){
+    s->block[s->used++] = *data++;
+    if(s->used == 64){
+      _sha1Block(s);
+      s->used = 0;
+    }
+  }
+}
+
+static void _sha1Final(AwsSha1 *s, uint8_t digest[20]){
+  uint32_t bits = s->total * 8;
+  uint8_t pad = 0x80;
+  _sha1Update(s, &pad, 1);
+  pad = 0;
+  while(s->used != 56)
+    _sha1Update(s, &pad, 1);
+  //keys are far too short for the upper half of the length to be set
+  uint8_t length[8] = { 0, 0, 0, 0, (uint8_t)(bits >> 24), (uint8_t)(bits >> 16), (uint8_t)(bits >> 8), (uint8_t)bits };
+  _sha1Update(s, length, 8);
+  for(uint8_t i = 0; i < 20; i++)
+    digest[i] = (uint8_t)(s->h[i >> 2] >> (24 - (i & 3) * 8));
+}
+
+static const char _base64Chars[] PROGMEM = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+//writes the 28 character accept key and a terminating zero to accept
+void webSocketAcceptKey(const char *key, size_t len, char *accept){
+  AwsSha1 sha;
+  uint8_t hash[21];
+  _sha1Init(&sha);
+  _sha1Update(&sha, (const uint8_t *)key, len);
+  _sha1Update(&sha, (const uint8_t *)WS_STR_UUID, strlen(WS_STR_UUID));
+  _sha1Final(&sha, hash);
+  //20 bytes are six whole groups and two bytes, padded with a zero byte and one '='
+  hash[20] = 0;
+  for(uint8_t i = 0; i < 7; i++){
+    uint32_t v = ((uint32_t)hash[i*3] << 16) | ((uint32_t)hash[i*3+1] << 8) | hash[i*3+2];
+    accept[i*4] = pgm_read_byte(_base64Chars + ((v >> 18) & 0x3F));
+    accept[i*4+1] = pgm_read_byte(_base64Chars + ((v >> 12) & 0x3F));
+    accept[i*4+2] = pgm_read_byte(_base64Chars + ((v >> 6) & 0x3F));
+    accept[i*4+3] = pgm_read_byte(_base64Chars + (v & 0x3F));
+  }
+  accept[27] = '=';
+  accept[28] = 0;
+}
+
+//accepts the first permessage-deflate offer that can be honoured without context takeover.
+//returns the window bits for our side, 0 if no offer fits
+static uint8_t _negotiateDeflate(const String& header, uint8_t windowBits, String& response){
+  int start = 0;
+  while(start < (int)header.length()){
+    int end = header.indexOf(',', start);
+    if(end < 0)
+      end = header.length();
+    String offer = header.substring(start, end);
+    start = end + 1;
+    int p = offer.indexOf(';');
+    String name = (p < 0)?offer:offer.substring(0, p);
+    name.trim();
+    if(name != WS_STR_DEFLATE)
+      continue;
+    uint8_t bits = windowBits;
+    bool valid = true;
+    while(p >= 0 && valid){
+      int next = offer.indexOf(';', p + 1);
+      String param = offer.substring(p + 1, (next < 0)?offer.length():next);
+      p = next;
+      int eq = param.indexOf('=');
+      String value = (eq < 0)?String():param.substring(eq + 1);
+      if(eq >= 0)
+        param = param.substring(0, eq);
+      param.trim();
+      value.trim();
+      if(value.length() > 1 && value[0] == '"')
+        value = value.substring(1, value.length() - 1);
+      long v = value.toInt();
+      if(param == "server_max_window_bits"){
+        if(v < 8 || v > 15)
+          valid = false;
+        else if(v < bits)
+          bits = v;
+      } else if(param == "client_max_window_bits"){
+        if(value.length() && (v < 8 || v > 15))
+          valid = false;
+      } else if(param != "server_no_context_takeover" && param != "client_no_context_takeover"){
+        valid = false;
+      }
+    }
+    if(!valid)
+      continue;
+    response = String(WS_STR_DEFLATE) + "; server_no_context_takeover; client_no_context_takeover";
+    if(bits < 15)
+      response += "; server_max_window_bits=" + String(bits);
+    return bits;
+  }
+  return 0;
+}
+
+//the first of our protocols the client offers, or the first one it offers if we have none
+String AsyncWebSocket::_negotiateProtocol(const String& offered){
+  for(const auto& p: _protocols){
+    int start = 0;
+    while(start < (int)offered.length()){
+      int end = offered.indexOf(',', start);
+      if(end < 0)
+        end = offered.length();
+      String name = offered.substring(start, end);
+      start = end + 1;
+      name.trim();
+      if(name == p)
+        return name;
+    }
+  }
+  if(!_protocols.isEmpty())
+    return String();
+  int end = offered.indexOf(',');
+  String first = (end < 0)?offered:offered.substring(0, end);
+  first.trim();
+  return first;
+}
+
 bool AsyncWebSocket::canHandle(AsyncWebServerRequest *request){
   if(!_enabled)
     return false;
@@ -1165,6 +2066,8 @@ bool AsyncWebSocket::canHandle(AsyncWebServerRequest *request){
   request->addInterestingHeader(WS_STR_VERSION);
   request->addInterestingHeader(WS_STR_KEY);
   request->addInterestingHeader(WS_STR_PROTOCOL);
+  if(_deflateBits)
+    request->addInterestingHeader(WS_STR_EXTENSIONS);
   return true;
 }
 
@@ -1184,12 +2087,19 @@ void AsyncWebSocket::handleRequest(AsyncWebServerRequest *request){
     return;
   }
   AsyncWebHeader* key = request->getHeader(WS_STR_KEY);
-  AsyncWebServerResponse *response = new AsyncWebSocketResponse(key->value(), this);
-  if(request->hasHeader(WS_STR_PROTOCOL)){
-    AsyncWebHeader* protocol = request->getHeader(WS_STR_PROTOCOL);
-    //ToDo: check protocol
-    response->addHeader(WS_STR_PROTOCOL, protocol->value());
-  }
+  uint8_t deflate = 0;
+  String extensions;
+  if(_deflateBits && request->hasHeader(WS_STR_EXTENSIONS))
+    deflate = _negotiateDeflate(request->getHeader(WS_STR_EXTENSIONS)->value(), _deflateBits, extensions);
+  String protocol;
+  if(request->hasHeader(WS_STR_PROTOCOL))
+    protocol = _negotiateProtocol(request->getHeader(WS_STR_PROTOCOL)->value());
+  AsyncWebServerResponse *response = new AsyncWebSocketResponse(key->value(), this, deflate, protocol);
+  if(deflate)
+    response->addHeader(WS_STR_EXTENSIONS, extensions);
+  //none of ours offered: answer without the header and let the client decide whether to go on
+  if(protocol.length())
+    response->addHeader(WS_STR_PROTOCOL, protocol);
   request->send(response);
 }
 
@@ -1215,11 +2125,8 @@ AsyncWebSocketMessageBuffer * AsyncWebSocket::makeBuffer(uint8_t * data, size_t
 
 void AsyncWebSocket::_cleanBuffers()
 {
-  for(AsyncWebSocketMessageBuffer * c: _buffers){
-    if(c && c->canDelete()){
-        _buffers.remove(c);
-    }
-  }
+  // removing while iterating would step into the freed node, take them one at a time
+  while(_buffers.remove_first([](AsyncWebSocketMessageBuffer * c){ return c && c->canDelete(); }));
 }
 
 
@@ -1228,40 +2135,13 @@ void AsyncWebSocket::_cleanBuffers()
  * Authentication code from https://github.com/Links2004/arduinoWebSockets/blob/master/src/WebSockets.cpp#L480
  */
 
-AsyncWebSocketResponse::AsyncWebSocketResponse(const String& key, AsyncWebSocket *server){
+AsyncWebSocketResponse::AsyncWebSocketResponse(const String& key, AsyncWebSocket *server, uint8_t deflate, const String& protocol){
   _server = server;
+  _deflate = deflate;
+  _protocol = protocol;
   _code = 101;
   _sendContentLength = false;
-
-  uint8_t * hash = (uint8_t*)malloc(20);
-  if(hash == NULL){
-    _state = RESPONSE_FAILED;
-    return;
-  }
-  char * buffer = (char *) malloc(33);
-  if(buffer == NULL){
-    free(hash);
-    _state = RESPONSE_FAILED;
-    return;
-  }
-#ifdef ESP8266
-  sha1(key + WS_STR_UUID, hash);
-#else
-  (String&)key += WS_STR_UUID;
-  SHA1_CTX ctx;
-  SHA1Init(&ctx);
-  SHA1Update(&ctx, (const unsigned char*)key.c_str(), key.length());
-  SHA1Final(hash, &ctx);
-#endif
-  base64_encodestate _state;
-  base64_init_encodestate(&_state);
-  int len = base64_encode_block((const char *) hash, 20, buffer, &_state);
-  len = base64_encode_blockend((buffer + len), &_state);
-  addHeader(WS_STR_CONNECTION, WS_STR_UPGRADE);
-  addHeader(WS_STR_UPGRADE, "websocket");
-  addHeader(WS_STR_ACCEPT,buffer);
-  free(buffer);
-  free(hash);
+  webSocketAcceptKey(key.c_str(), key.length(), _accept);
 }
 
 void AsyncWebSocketResponse::_respond(AsyncWebServerRequest *request){
@@ -1269,14 +2149,36 @@ void AsyncWebSocketResponse::_respond(AsyncWebServerRequest *request){
     request->client()->close(true);
     return;
   }
-  String out = _assembleHead(request->version());
+  //the upgrade head never changes, only the accept key and the negotiated headers follow it
+  static const char head[] PROGMEM = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: websocket\r\nSec-WebSocket-Accept: ";
+  size_t len = sizeof(head) - 1 + 28 + 2;
+  for(const auto& header: _headers)
+    len += header->name().length() + header->value().length() + 4;
+  len += 2;
+  String out;
+  if(!out.reserve(len)){
+    request->client()->close(true);
+    return;
+  }
+  out.concat(reinterpret_cast<const __FlashStringHelper *>(head));
+  out.concat(_accept);
+  out.concat("\r\n");
+  for(const auto& header: _headers){
+    out.concat(header->name());
+    out.concat(": ");
+    out.concat(header->value());
+    out.concat("\r\n");
+  }
+  _headers.free();
+  out.concat("\r\n");
+  _headLength = out.length();
   request->client()->write(out.c_str(), _headLength);
   _state = RESPONSE_WAIT_ACK;
 }
 
 size_t AsyncWebSocketResponse::_ack(AsyncWebServerRequest *request, size_t len, uint32_t time){
   if(len){
-    new AsyncWebSocketClient(request, _server);
+    new AsyncWebSocketClient(request, _server, _deflate, _protocol);
   }
   return 0;
 }
@@ -25,20 +25,48 @@
 #ifdef ESP32
 #include <AsyncTCP.h>
 #define WS_MAX_QUEUED_MESSAGES 32
+#ifndef WS_MAX_MESSAGE_SIZE
+#define WS_MAX_MESSAGE_SIZE 16384
+#endif
 #else
 #include <ESPAsyncTCP.h>
 #define WS_MAX_QUEUED_MESSAGES 8
+#ifndef WS_MAX_MESSAGE_SIZE
+#define WS_MAX_MESSAGE_SIZE 4096
+#endif
 #endif
 #include <ESPAsyncWebServer.h>
+#include "AsyncTimerWheel.h"
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+
+// frames with up to this many payload bytes are added to the client together with their header
+#ifndef WS_COALESCE_FRAME_SIZE
+#define WS_COALESCE_FRAME_SIZE 128
+#endif
+
+//messages shorter than this are sent uncompressed even when permessage-deflate is negotiated
+#ifndef WS_DEFLATE_MIN_SIZE
+#define WS_DEFLATE_MIN_SIZE 64
+#endif
+
+//RSV1 of the first frame marks a compressed message, carried along with the opcode
+#define WS_COMPRESSED 0x40
 
-#ifdef ESP8266
-#include <Hash.h>
+//message buffers keep room for the largest frame header in front of the payload
+#define WS_FRAME_HEADROOM 10
+
+//largest frame a stream message fills at once, the buffer it is filled in is allocated while the message is sent
+#ifndef WS_STREAM_CHUNK_SIZE
+#define WS_STREAM_CHUNK_SIZE 1460
 #endif
 
 class AsyncWebSocket;
 class AsyncWebSocketResponse;
 class AsyncWebSocketClient;
 class AsyncWebSocketControl;
+class AsyncWebSocketMessage;
 
 typedef struct {
     /** Message type as defined by enum AwsFrameType.
@@ -68,6 +96,39 @@ typedef enum { WS_DISCONNECTED, WS_CONNECTED, WS_DISCONNECTING } AwsClientStatus
 typedef enum { WS_CONTINUATION, WS_TEXT, WS_BINARY, WS_DISCONNECT = 0x08, WS_PING, WS_PONG } AwsFrameType;
 typedef enum { WS_MSG_SENDING, WS_MSG_SENT, WS_MSG_ERROR } AwsMessageStatus;
 typedef enum { WS_EVT_CONNECT, WS_EVT_DISCONNECT, WS_EVT_PONG, WS_EVT_ERROR, WS_EVT_DATA } AwsEventType;
+//what happens to a message sent to a client whose queue is full
+typedef enum { WS_QUEUE_DROP_NEWEST, WS_QUEUE_DROP_OLDEST, WS_QUEUE_COALESCE, WS_QUEUE_DISCONNECT } AwsBackpressurePolicy;
+
+typedef struct {
+    /** Messages waiting in the queue, including the one being sent. */
+    size_t length;
+    /** Most messages the queue can hold. */
+    size_t capacity;
+    /** Longest the queue has been. */
+    size_t highWatermark;
+    /** Messages accepted into the queue. */
+    uint32_t queued;
+    /** Messages dropped because the queue was full. */
+    uint32_t dropped;
+    /** Queued messages replaced by a newer one with the same tag. */
+    uint32_t coalesced;
+} AwsQueueStats;
+
+typedef struct {
+    /** Message the bytes belong to, NULL for control frames and for messages that are gone. */
+    AsyncWebSocketMessage *message;
+    /** Bytes not acked yet. */
+    size_t len;
+    /** Opcode of a control frame. */
+    uint8_t opcode;
+} AwsInFlight;
+
+typedef struct {
+    /** Name the clients subscribed with. */
+    String name;
+    /** Subscribed clients, in the order they subscribed. */
+    std::vector<AsyncWebSocketClient *> clients;
+} AwsTopic;
 
 class AsyncWebSocketMessageBuffer {
   private:
@@ -75,6 +136,14 @@ class AsyncWebSocketMessageBuffer {
     size_t _len;
     bool _lock; 
     uint32_t _count;  
+    uint32_t _tag;
+    uint8_t * _deflated;
+    size_t _deflatedLen;
+    uint8_t _deflateBits;
+    uint8_t _frameOpcode;
+    uint8_t _frameHead;
+    uint8_t _deflatedHead;
+    uint8_t * _allocate(size_t len);
 
   public:
     AsyncWebSocketMessageBuffer();
@@ -92,6 +161,15 @@ class AsyncWebSocketMessageBuffer {
     size_t length() { return _len; }
     uint32_t count() { return _count; }
     bool canDelete() { return (!_count && !_lock); } 
+    //messages with the same non zero tag replace each other in the queue of a WS_QUEUE_COALESCE client
+    void setTag(uint32_t tag) { _tag = tag; }
+    uint32_t tag() { return _tag; }
+    //compressed copy for permessage-deflate clients, made once and shared by all of them
+    bool deflate(uint8_t windowBits);
+    uint8_t * deflated() { return _deflated; }
+    size_t deflatedLength() { return _deflatedLen; }
+    //the complete unmasked frame for the plain or compressed payload, NULL if it was built with another opcode
+    uint8_t * frame(uint8_t opcode, bool deflated, size_t * len);
 
     friend AsyncWebSocket; 
 
@@ -102,13 +180,19 @@ class AsyncWebSocketMessage {
     uint8_t _opcode;
     bool _mask;
     AwsMessageStatus _status;
+    uint32_t _tag;
   public:
-    AsyncWebSocketMessage():_opcode(WS_TEXT),_mask(false),_status(WS_MSG_ERROR){}
+    AsyncWebSocketMessage():_opcode(WS_TEXT),_mask(false),_status(WS_MSG_ERROR),_tag(0){}
     virtual ~AsyncWebSocketMessage(){}
     virtual void ack(size_t len __attribute__((unused)), uint32_t time __attribute__((unused))){}
     virtual size_t send(AsyncClient *client __attribute__((unused))){ return 0; }
     virtual bool finished(){ return _status != WS_MSG_SENDING; }
     virtual bool betweenFrames() const { return false; }
+    //the whole message has been handed to the client
+    virtual bool sent() const { return false; }
+    //nothing of the message has been handed to the client, it can still be dropped
+    virtual bool unsent() const { return false; }
+    uint32_t tag() const { return _tag; }
 };
 
 class AsyncWebSocketBasicMessage: public AsyncWebSocketMessage {
@@ -122,7 +206,11 @@ public:
     AsyncWebSocketBasicMessage(const char * data, size_t len, uint8_t opcode=WS_TEXT, bool mask=false);
     AsyncWebSocketBasicMessage(uint8_t opcode=WS_TEXT, bool mask=false);
     virtual ~AsyncWebSocketBasicMessage() override;
-    virtual bool betweenFrames() const override { return _acked == _ack; }
+    //compresses the message before it is sent, false if it stays as it is
+    bool deflate(uint8_t windowBits);
+    virtual bool betweenFrames() const override { return true; }
+    virtual bool sent() const override { return _sent == _len && _ack; }
+    virtual bool unsent() const override { return _ack == 0; }
     virtual void ack(size_t len, uint32_t time) override ;
     virtual size_t send(AsyncClient *client) override ;
 };
@@ -135,10 +223,38 @@ class AsyncWebSocketMultiMessage: public AsyncWebSocketMessage {
     size_t _ack;
     size_t _acked;
     AsyncWebSocketMessageBuffer * _WSbuffer; 
+    bool _frame;
 public:
-    AsyncWebSocketMultiMessage(AsyncWebSocketMessageBuffer * buffer, uint8_t opcode=WS_TEXT, bool mask=false); 
+    AsyncWebSocketMultiMessage(AsyncWebSocketMessageBuffer * buffer, uint8_t opcode=WS_TEXT, bool mask=false, uint8_t deflate=0); 
     virtual ~AsyncWebSocketMultiMessage() override;
-    virtual bool betweenFrames() const override { return _acked == _ack; }
+    virtual bool betweenFrames() const override { return !_frame || _sent == 0 || _sent == _len; }
+    virtual bool sent() const override { return _sent == _len && _ack; }
+    virtual bool unsent() const override { return _ack == 0; }
+    virtual void ack(size_t len, uint32_t time) override ;
+    virtual size_t send(AsyncClient *client) override ;
+};
+
+//message produced while it is sent, in frames as large as the TCP window allows, so it is never in memory whole
+class AsyncWebSocketStreamMessage: public AsyncWebSocketMessage {
+  private:
+    AwsResponseFiller _filler;
+    File _file;
+    size_t _total;
+    size_t _index;
+    size_t _ack;
+    size_t _acked;
+    uint8_t * _chunk;
+    bool _done;
+public:
+    //the filler returns the bytes it wrote, 0 at the end of the message or RESPONSE_TRY_AGAIN if it has nothing yet
+    AsyncWebSocketStreamMessage(AwsResponseFiller filler, uint8_t opcode=WS_BINARY);
+    //the file is closed when the message is done
+    AsyncWebSocketStreamMessage(File file, uint8_t opcode=WS_BINARY);
+    virtual ~AsyncWebSocketStreamMessage() override;
+    //only whole frames are added to the client
+    virtual bool betweenFrames() const override { return true; }
+    virtual bool sent() const override { return _done; }
+    virtual bool unsent() const override { return _ack == 0; }
     virtual void ack(size_t len, uint32_t time) override ;
     virtual size_t send(AsyncClient *client) override ;
 };
@@ -151,22 +267,51 @@ class AsyncWebSocketClient {
     AwsClientStatus _status;
 
     LinkedList<AsyncWebSocketControl *> _controlQueue;
-    LinkedList<AsyncWebSocketMessage *> _messageQueue;
+    //frames added to the client and not acked yet, in the order they were added
+    std::vector<AwsInFlight> _inFlight;
+    RingQueue<AsyncWebSocketMessage *> _messageQueue;
+    size_t _queueHighWatermark;
+    uint32_t _queued;
+    uint32_t _dropped;
+    uint32_t _coalesced;
+    AwsBackpressurePolicy _backpressure;
 
     uint8_t _pstate;
     AwsFrameInfo _pinfo;
+    uint8_t _pheader[14];
+    uint8_t _pheaderLen;
+    uint8_t *_pcontrol;
+    bool _pfragmented;
+    bool _pcompressed;
+    uint8_t *_pmessage;
+    size_t _pmessageLen;
+    size_t _pmessageSize;
 
     uint32_t _lastMessageTime;
     uint32_t _keepAlivePeriod;
+    uint32_t _pongTimeout;
+    bool _awaitingPong;
+    uint8_t _deflate;
+    String _protocol;
+    AsyncTimer _keepAliveTimer;
 
     void _queueMessage(AsyncWebSocketMessage *dataMessage);
+    size_t _dropUnsent(size_t count);
     void _queueControl(AsyncWebSocketControl *controlMessage);
+    void _addInFlight(AsyncWebSocketMessage *message, uint8_t opcode, size_t len);
+    void _forgetInFlight(AsyncWebSocketMessage *message);
     void _runQueue();
+    void _handleControl(uint8_t *data, size_t len);
+    bool _reserveMessage(uint64_t len);
+    void _completeMessage();
+    AsyncWebSocketMessage * _deflateMessage(AsyncWebSocketBasicMessage *message);
+    void _failConnection(uint16_t code);
+    void _onKeepAlive();
 
   public:
     void *_tempObject;
 
-    AsyncWebSocketClient(AsyncWebServerRequest *request, AsyncWebSocket *server);
+    AsyncWebSocketClient(AsyncWebServerRequest *request, AsyncWebSocket *server, uint8_t deflate=0, const String& protocol=String());
     ~AsyncWebSocketClient();
 
     //client id increments for the given server
@@ -175,29 +320,41 @@ class AsyncWebSocketClient {
     AsyncClient* client(){ return _client; }
     AsyncWebSocket *server(){ return _server; }
     AwsFrameInfo const &pinfo() const { return _pinfo; }
+    //window bits of the negotiated permessage-deflate, 0 if messages are not compressed
+    uint8_t deflate() const { return _deflate; }
+    //subprotocol selected from Sec-WebSocket-Protocol, empty if none
+    const String& protocol() const { return _protocol; }
 
     IPAddress remoteIP();
     uint16_t  remotePort();
 
+    //topics of AsyncWebSocket::publish
+    bool subscribe(const String& topic);
+    bool unsubscribe(const String& topic);
+
     //control frames
     void close(uint16_t code=0, const char * message=NULL);
     void ping(uint8_t *data=NULL, size_t len=0);
 
     //set auto-ping period in seconds. disabled if zero (default)
-    void keepAlivePeriod(uint16_t seconds){
-      _keepAlivePeriod = seconds * 1000;
-    }
+    //with a pong timeout the client is closed when nothing comes back within that many seconds of a ping
+    void keepAlivePeriod(uint16_t seconds, uint16_t pongTimeout=0);
     uint16_t keepAlivePeriod(){
       return (uint16_t)(_keepAlivePeriod / 1000);
     }
+    uint16_t pongTimeout(){
+      return (uint16_t)(_pongTimeout / 1000);
+    }
 
     //data packets
     void message(AsyncWebSocketMessage *message){ _queueMessage(message); }
     bool queueIsFull();
 
     size_t printf(const char *format, ...)  __attribute__ ((format (printf, 2, 3)));
+    size_t vprintf(const char *format, va_list arg);
 #ifndef ESP32
     size_t printf_P(PGM_P formatP, ...)  __attribute__ ((format (printf, 2, 3)));
+    size_t vprintf_P(PGM_P formatP, va_list arg);
 #endif
     void text(const char * message, size_t len);
     void text(const char * message);
@@ -215,7 +372,14 @@ class AsyncWebSocketClient {
     void binary(const __FlashStringHelper *data, size_t len);
     void binary(AsyncWebSocketMessageBuffer *buffer); 
 
-    bool canSend() { return _messageQueue.length() < WS_MAX_QUEUED_MESSAGES; }
+    //messages too large to keep in memory, see AsyncWebSocketStreamMessage
+    void stream(AwsResponseFiller filler, uint8_t opcode=WS_BINARY);
+    void stream(File file, uint8_t opcode=WS_BINARY);
+
+    bool canSend() { return !_messageQueue.isFull(); }
+    AwsQueueStats queueStats() const;
+    void setBackpressure(AwsBackpressurePolicy policy) { _backpressure = policy; }
+    AwsBackpressurePolicy backpressure() const { return _backpressure; }
 
     //system callbacks (do not call)
     void _onAck(size_t len, uint32_t time);
@@ -227,14 +391,27 @@ class AsyncWebSocketClient {
 };
 
 typedef std::function<void(AsyncWebSocket * server, AsyncWebSocketClient * client, AwsEventType type, void * arg, uint8_t *data, size_t len)> AwsEventHandler;
+typedef std::function<void(AsyncWebSocketClient * client, uint8_t opcode, uint8_t *data, size_t len)> AwsMessageHandler;
 
 //WebServer Handler implementation that plays the role of a socket server
 class AsyncWebSocket: public AsyncWebHandler {
   private:
     String _url;
-    LinkedList<AsyncWebSocketClient *> _clients;
+    //clients in a flat array for the *All methods, and the position of every id in it
+    std::vector<AsyncWebSocketClient *> _clients;
+    std::unordered_map<uint32_t, size_t> _clientIndex;
+    std::vector<AwsTopic> _topics;
+    StringArray _protocols;
     uint32_t _cNextId;
     AwsEventHandler _eventHandler;
+    AwsMessageHandler _messageHandler;
+    size_t _maxMessageSize;
+    size_t _maxQueuedMessages;
+    AwsBackpressurePolicy _backpressure;
+    uint16_t _keepAlivePeriod;
+    uint16_t _pongTimeout;
+    AsyncTimerWheel _timerWheel;
+    uint8_t _deflateBits;
     bool _enabled;
   public:
     AsyncWebSocket(const String& url);
@@ -247,6 +424,7 @@ class AsyncWebSocket: public AsyncWebHandler {
 
     size_t count() const;
     AsyncWebSocketClient * client(uint32_t id);
+    AsyncWebSocketClient * _findClient(uint32_t id);
     bool hasClient(uint32_t id){ return client(id) != NULL; }
 
     void close(uint32_t id, uint16_t code=0, const char * message=NULL);
@@ -288,6 +466,15 @@ class AsyncWebSocket: public AsyncWebHandler {
     void message(uint32_t id, AsyncWebSocketMessage *message);
     void messageAll(AsyncWebSocketMultiMessage *message);
 
+    //topics, a client leaves all of them when it disconnects
+    bool subscribe(uint32_t id, const String& topic);
+    bool unsubscribe(uint32_t id, const String& topic);
+    size_t subscribers(const String& topic);
+    //sends the buffer to the subscribers of the topic, all of them share it. returns the number of clients
+    size_t publish(const String& topic, AsyncWebSocketMessageBuffer * buffer, uint8_t opcode=WS_TEXT);
+    size_t publish(const String& topic, const char * message, size_t len, uint8_t opcode=WS_TEXT);
+    size_t publish(const String& topic, const String& message);
+
     size_t printf(uint32_t id, const char *format, ...)  __attribute__ ((format (printf, 3, 4)));
     size_t printfAll(const char *format, ...)  __attribute__ ((format (printf, 2, 3)));
 #ifndef ESP32
@@ -300,11 +487,44 @@ class AsyncWebSocket: public AsyncWebHandler {
       _eventHandler = handler;
     }
 
+    //listener for whole messages, reassembled from their fragments. WS_EVT_DATA events are still sent
+    void onMessage(AwsMessageHandler handler){
+      _messageHandler = handler;
+    }
+    //messages longer than this close the client with 1009
+    void setMaxMessageSize(size_t size){ _maxMessageSize = size; }
+    size_t maxMessageSize() const { return _maxMessageSize; }
+
+    //capacity of the message queue of clients that connect from now on, WS_MAX_QUEUED_MESSAGES by default
+    void setMaxQueuedMessages(size_t count){ _maxQueuedMessages = count ? count : 1; }
+    size_t maxQueuedMessages() const { return _maxQueuedMessages; }
+    //what clients that connect from now on do when their queue is full, WS_QUEUE_DROP_NEWEST by default
+    void setBackpressure(AwsBackpressurePolicy policy){ _backpressure = policy; }
+    AwsBackpressurePolicy backpressure() const { return _backpressure; }
+    //auto-ping period and pong timeout in seconds of clients that connect from now on, disabled by default
+    void keepAlivePeriod(uint16_t seconds, uint16_t pongTimeout=0){ _keepAlivePeriod = seconds; _pongTimeout = pongTimeout; }
+    uint16_t keepAlivePeriod() const { return _keepAlivePeriod; }
+    uint16_t pongTimeout() const { return _pongTimeout; }
+
+    //subprotocols in order of preference. Without any, the first one the client offers is accepted
+    void addProtocol(const String& protocol){ _protocols.add(protocol); }
+
+    //offer permessage-deflate (RFC 7692). Context takeover is never used, so a broadcast is compressed once for all clients
+    void setDeflate(bool enabled, uint8_t windowBits=15){ _deflateBits = enabled?std::min(std::max(windowBits, (uint8_t)8), (uint8_t)15):0; }
+
     //system callbacks (do not call)
     uint32_t _getNextId(){ return _cNextId++; }
     void _addClient(AsyncWebSocketClient * client);
     void _handleDisconnect(AsyncWebSocketClient * client);
     void _handleEvent(AsyncWebSocketClient * client, AwsEventType type, void * arg, uint8_t *data, size_t len);
+    bool _hasMessageHandler() const { return (bool)_messageHandler; }
+    void _handleMessage(AsyncWebSocketClient * client, uint8_t opcode, uint8_t *data, size_t len);
+    void _deflateBuffer(AsyncWebSocketMessageBuffer * buffer, const std::vector<AsyncWebSocketClient *> &clients);
+    AwsTopic * _findTopic(const String& topic);
+    void _unsubscribeAll(AsyncWebSocketClient * client);
+    String _negotiateProtocol(const String& offered);
+    //keepalive deadlines of all clients, advanced from their polls
+    AsyncTimerWheel & _timers(){ return _timerWheel; }
     virtual bool canHandle(AsyncWebServerRequest *request) override final;
     virtual void handleRequest(AsyncWebServerRequest *request) override final;
 
@@ -321,8 +541,11 @@ class AsyncWebSocketResponse: public AsyncWebServerResponse {
   private:
     String _content;
     AsyncWebSocket *_server;
+    uint8_t _deflate;
+    String _protocol;
+    char _accept[29];
   public:
-    AsyncWebSocketResponse(const String& key, AsyncWebSocket *server);
+    AsyncWebSocketResponse(const String& key, AsyncWebSocket *server, uint8_t deflate=0, const String& protocol=String());
     void _respond(AsyncWebServerRequest *request);
     size_t _ack(AsyncWebServerRequest *request, size_t len, uint32_t time);
     bool _sourceValid() const { return true; }
@@ -0,0 +1,77 @@
+/*
+  Asynchronous WebServer library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef ASYNCWEBSYNCHRONIZATION_H_
+#define ASYNCWEBSYNCHRONIZATION_H_
+
+#include "Arduino.h"
+
+#ifdef ESP32
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+/*
+ * Recursive lock for state that the async_tcp task and application tasks both touch.
+ * The task that holds it may take it again, so callbacks can call back into the locked object.
+ */
+class AsyncWebLock {
+  private:
+    SemaphoreHandle_t _lock;
+
+  public:
+    AsyncWebLock() : _lock(xSemaphoreCreateRecursiveMutex()) {}
+    ~AsyncWebLock(){
+      if(_lock != NULL)
+        vSemaphoreDelete(_lock);
+    }
+    AsyncWebLock(const AsyncWebLock&) = delete;
+    AsyncWebLock& operator=(const AsyncWebLock&) = delete;
+
+    void lock(){
+      if(_lock != NULL)
+        xSemaphoreTakeRecursive(_lock, portMAX_DELAY);
+    }
+    void unlock(){
+      if(_lock != NULL)
+        xSemaphoreGiveRecursive(_lock);
+    }
+};
+#else
+//ESP8266 runs the network callbacks and the sketch in the same context, there is nothing to lock against
+class AsyncWebLock {
+  public:
+    void lock(){}
+    void unlock(){}
+};
+#endif
+
+//holds the lock for the scope it is declared in
+class AsyncWebLockGuard {
+  private:
+    AsyncWebLock &_lock;
+
+  public:
+    AsyncWebLockGuard(AsyncWebLock &lock) : _lock(lock) { _lock.lock(); }
+    ~AsyncWebLockGuard(){ _lock.unlock(); }
+    AsyncWebLockGuard(const AsyncWebLockGuard&) = delete;
+    AsyncWebLockGuard& operator=(const AsyncWebLockGuard&) = delete;
+};
+
+#endif /* ASYNCWEBSYNCHRONIZATION_H_ */
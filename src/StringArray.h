@@ -171,6 +171,91 @@ class LinkedList {
     }
 };
 
+template <typename T>
+class RingQueue {
+  public:
+    typedef std::function<void(const T&)> OnRemove;
+  private:
+    T* _items;
+    size_t _capacity;
+    size_t _head;
+    size_t _length;
+    OnRemove _onRemove;
+
+    class Iterator {
+      const RingQueue* _queue;
+      size_t _index;
+    public:
+      Iterator(const RingQueue* queue, size_t index) : _queue(queue), _index(index) {}
+      Iterator& operator ++() { _index++; return *this; }
+      bool operator != (const Iterator& i) const { return _index != i._index; }
+      const T& operator * () const { return (*_queue)[_index]; }
+    };
+
+  public:
+    typedef const Iterator ConstIterator;
+    ConstIterator begin() const { return ConstIterator(this, 0); }
+    ConstIterator end() const { return ConstIterator(this, _length); }
+
+    RingQueue(size_t capacity, OnRemove onRemove) : _items(new T[capacity ? capacity : 1]), _capacity(capacity ? capacity : 1), _head(0), _length(0), _onRemove(onRemove) {}
+    ~RingQueue(){ delete[] _items; }
+    RingQueue(const RingQueue&) = delete;
+    RingQueue& operator=(const RingQueue&) = delete;
+
+    //false when the queue is full, the item is then not added
+    bool add(const T& t){
+      if(_length == _capacity)
+        return false;
+      _items[(_head + _length++) % _capacity] = t;
+      return true;
+    }
+    T& front() const { return _items[_head]; }
+    T& back() const { return _items[(_head + _length - 1) % _capacity]; }
+    T& operator [] (size_t i) const { return _items[(_head + i) % _capacity]; }
+
+    bool isEmpty() const { return _length == 0; }
+    bool isFull() const { return _length == _capacity; }
+    size_t length() const { return _length; }
+    size_t capacity() const { return _capacity; }
+
+    void pop_front(){
+      if(!_length)
+        return;
+      T t = _items[_head];
+      _head = (_head + 1) % _capacity;
+      _length--;
+      if (_onRemove) {
+        _onRemove(t);
+      }
+    }
+    //removes the item at position i, the items behind it move up one place
+    void remove_at(size_t i){
+      if(i >= _length)
+        return;
+      T t = (*this)[i];
+      for(; i + 1 < _length; i++)
+        (*this)[i] = (*this)[i + 1];
+      _length--;
+      if (_onRemove) {
+        _onRemove(t);
+      }
+    }
+    bool remove(const T& t){
+      for(size_t i = 0; i < _length; i++){
+        if((*this)[i] == t){
+          remove_at(i);
+          return true;
+        }
+      }
+      return false;
+    }
+    void free(){
+      while(_length)
+        pop_front();
+      _head = 0;
+    }
+};
+
 
 class StringArray : public LinkedList<String> {
 public:
@@ -32,6 +32,9 @@ class AsyncStaticWebHandler: public AsyncWebHandler {
     bool _getFile(AsyncWebServerRequest *request);
     bool _fileExists(AsyncWebServerRequest *request, const String& path);
     uint8_t _countBits(const uint8_t value) const;
+    bool _notModified(AsyncWebServerRequest *request, const String& etag, time_t lastModified, const String& lastModifiedStr);
+    bool _dirExists(AsyncWebServerRequest *request, const String& path);
+    void _sendDirectory(AsyncWebServerRequest *request, const String& path);
   protected:
     FS _fs;
     String _uri;
@@ -39,10 +42,13 @@ class AsyncStaticWebHandler: public AsyncWebHandler {
     String _default_file;
     String _cache_control;
     String _last_modified;
+    time_t _last_modified_time;
     AwsTemplateProcessor _callback;
     bool _isDir;
     bool _gzipFirst;
     uint8_t _gzipStats;
+    bool _dirListing;
+    size_t _dirPageSize;
   public:
     AsyncStaticWebHandler(const char* uri, FS& fs, const char* path, const char* cache_control);
     virtual bool canHandle(AsyncWebServerRequest *request) override final;
@@ -57,6 +63,8 @@ class AsyncStaticWebHandler: public AsyncWebHandler {
     AsyncStaticWebHandler& setLastModified(); //sets to current time. Make sure sntp is runing and time is updated
   #endif
     AsyncStaticWebHandler& setTemplateProcessor(AwsTemplateProcessor newCallback) {_callback = newCallback; return *this;}
+    //list directories without a default file, pageSize limits the entries per response (0 means all)
+    AsyncStaticWebHandler& setDirectoryListing(bool enabled, size_t pageSize=0) {_dirListing = enabled; _dirPageSize = pageSize; return *this;}
 };
 
 class AsyncCallbackWebHandler: public AsyncWebHandler {
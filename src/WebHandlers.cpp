@@ -20,9 +20,93 @@
 */
 #include "ESPAsyncWebServer.h"
 #include "WebHandlerImpl.h"
+#include <memory>
+
+/*
+ * HTTP-date (RFC 7231 7.1.1.1) helpers for conditional requests
+ * */
+
+static int _httpMonth(const char *name){
+  static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  for(int i = 0; i < 12; i++){
+    if(strncasecmp(name, months + (i * 3), 3) == 0)
+      return i + 1;
+  }
+  return 0;
+}
+
+// days since 1970-01-01 of a proleptic gregorian date
+static time_t _httpDaysFromCivil(int y, unsigned m, unsigned d){
+  y -= m <= 2;
+  const int era = (y >= 0 ? y : y - 399) / 400;
+  const unsigned yoe = (unsigned)(y - era * 400);
+  const unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+  const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return (time_t)era * 146097 + (time_t)doe - 719468;
+}
+
+// accepts IMF-fixdate, the obsolete RFC 850 format and asctime(), as required from recipients
+static bool _parseHttpDate(const char *date, time_t *out){
+  char mon[4];
+  int day, month = 0, year, hour, min, sec;
+  bool ok = false;
+  const char *comma = strchr(date, ',');
+  if(comma){
+    // Sun, 06 Nov 1994 08:49:37 GMT
+    ok = sscanf(comma + 1, " %2d %3s %4d %2d:%2d:%2d", &day, mon, &year, &hour, &min, &sec) == 6 && (month = _httpMonth(mon));
+    if(!ok){
+      // Sunday, 06-Nov-94 08:49:37 GMT
+      ok = sscanf(comma + 1, " %2d-%3s-%4d %2d:%2d:%2d", &day, mon, &year, &hour, &min, &sec) == 6 && (month = _httpMonth(mon));
+      if(ok && year < 100)
+        year += (year < 70) ? 2000 : 1900;
+    }
+  } else {
+    // Sun Nov  6 08:49:37 1994
+    ok = sscanf(date, "%*s %3s %2d %2d:%2d:%2d %4d", mon, &day, &hour, &min, &sec, &year) == 6 && (month = _httpMonth(mon));
+  }
+  if(!ok || day < 1 || day > 31 || hour > 23 || min > 59 || sec > 60 || year < 1970)
+    return false;
+  *out = _httpDaysFromCivil(year, month, day) * 86400 + hour * 3600 + min * 60 + sec;
+  return true;
+}
+
+static String _httpDate(time_t t){
+  struct tm tm;
+  char buf[32];
+  gmtime_r(&t, &tm);
+  strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  return String(buf);
+}
+
+// weak comparison against a list of entity tags (RFC 7232 3.2), "*" matches any
+static bool _etagMatches(const String& header, const String& etag){
+  const char *tag = etag.c_str();
+  if(tag[0] == 'W' && tag[1] == '/')
+    tag += 2;
+  const size_t tagLen = strlen(tag);
+  const char *p = header.c_str();
+  while(*p){
+    while(*p == ' ' || *p == '\t' || *p == ',') p++;
+    if(*p == '*')
+      return true;
+    if(p[0] == 'W' && p[1] == '/')
+      p += 2;
+    const char *start = p;
+    if(*p == '"'){
+      const char *end = strchr(p + 1, '"');
+      p = end ? end + 1 : p + strlen(p);
+    } else {
+      // be lenient with unquoted tags
+      while(*p && *p != ',' && *p != ' ' && *p != '\t') p++;
+    }
+    if((size_t)(p - start) == tagLen && memcmp(start, tag, tagLen) == 0)
+      return true;
+  }
+  return false;
+}
 
 AsyncStaticWebHandler::AsyncStaticWebHandler(const char* uri, FS& fs, const char* path, const char* cache_control)
-  : _fs(fs), _uri(uri), _path(path), _default_file("index.htm"), _cache_control(cache_control), _last_modified(""), _callback(nullptr)
+  : _fs(fs), _uri(uri), _path(path), _default_file("index.htm"), _cache_control(cache_control), _last_modified(""), _last_modified_time(0), _callback(nullptr)
 {
   // Ensure leading '/'
   if (_uri.length() == 0 || _uri[0] != '/') _uri = "/" + _uri;
@@ -40,6 +124,8 @@ AsyncStaticWebHandler::AsyncStaticWebHandler(const char* uri, FS& fs, const char
   // Reset stats
   _gzipFirst = false;
   _gzipStats = 0xF8;
+  _dirListing = false;
+  _dirPageSize = 0;
 }
 
 AsyncStaticWebHandler& AsyncStaticWebHandler::setIsDir(bool isDir){
@@ -59,12 +145,14 @@ AsyncStaticWebHandler& AsyncStaticWebHandler::setCacheControl(const char* cache_
 
 AsyncStaticWebHandler& AsyncStaticWebHandler::setLastModified(const char* last_modified){
   _last_modified = String(last_modified);
+  if(!_parseHttpDate(_last_modified.c_str(), &_last_modified_time))
+    _last_modified_time = 0;
   return *this;
 }
 
 AsyncStaticWebHandler& AsyncStaticWebHandler::setLastModified(struct tm* last_modified){
-  char result[30];
-  strftime (result,30,"%a, %d %b %Y %H:%M:%S %Z", last_modified);
+  char result[32];
+  strftime (result,32,"%a, %d %b %Y %H:%M:%S GMT", last_modified);
   return setLastModified((const char *)result);
 }
 
@@ -88,12 +176,11 @@ bool AsyncStaticWebHandler::canHandle(AsyncWebServerRequest *request){
     return false;
   }
   if (_getFile(request)) {
-    // We interested in "If-Modified-Since" header to check if file was modified
-    if (_last_modified.length())
-      request->addInterestingHeader(F("If-Modified-Since"));
-
-    if(_cache_control.length())
-      request->addInterestingHeader(F("If-None-Match"));
+    // We interested in "If-Modified-Since" and "If-None-Match" headers to check if file was modified
+    request->addInterestingHeader(F("If-Modified-Since"));
+    request->addInterestingHeader(F("If-None-Match"));
+    if (_dirListing)
+      request->addInterestingHeader(F("Accept"));
 
     DEBUGF("[AsyncStaticWebHandler::canHandle] TRUE\n");
     return true;
@@ -116,16 +203,15 @@ bool AsyncStaticWebHandler::_getFile(AsyncWebServerRequest *request)
   if (!canSkipFileCheck && _fileExists(request, path))
     return true;
 
-  // Can't handle if not default file
-  if (_default_file.length() == 0)
-    return false;
-
   // Try to add default file, ensure there is a trailing '/' ot the path.
   if (path.length() == 0 || path[path.length()-1] != '/')
     path += "/";
-  path += _default_file;
 
-  return _fileExists(request, path);
+  if (_default_file.length() && _fileExists(request, path + _default_file))
+    return true;
+
+  // Without a default file, list the directory if allowed
+  return _dirListing && _dirExists(request, path);
 }
 
 #ifdef ESP32
@@ -176,6 +262,27 @@ bool AsyncStaticWebHandler::_fileExists(AsyncWebServerRequest *request, const St
   return found;
 }
 
+bool AsyncStaticWebHandler::_dirExists(AsyncWebServerRequest *request, const String& path)
+{
+#ifdef ESP32
+  request->_tempFile = _fs.open(path.length() > 1 ? path.substring(0, path.length()-1) : path, "r");
+  bool found = request->_tempFile == true && request->_tempFile.isDirectory();
+  if (!found)
+    request->_tempFile = File();
+#else
+  // SPIFFS has no directories, anything stored under the prefix counts
+  bool found = _fs.exists(path.substring(0, path.length()-1)) || _fs.openDir(path).next();
+#endif
+  if (found) {
+    // Keep the path with its trailing '/' so handleRequest knows it is a directory
+    size_t pathLen = path.length();
+    char * _tempPath = (char*)malloc(pathLen+1);
+    snprintf(_tempPath, pathLen+1, "%s", path.c_str());
+    request->_tempObject = (void*)_tempPath;
+  }
+  return found;
+}
+
 uint8_t AsyncStaticWebHandler::_countBits(const uint8_t value) const
 {
   uint8_t w = value;
@@ -193,28 +300,299 @@ void AsyncStaticWebHandler::handleRequest(AsyncWebServerRequest *request)
   if((_username != "" && _password != "") && !request->authenticate(_username.c_str(), _password.c_str()))
       return request->requestAuthentication();
 
-  if (request->_tempFile == true) {
-    String etag = String(request->_tempFile.size());
-    if (_last_modified.length() && _last_modified == request->header(F("If-Modified-Since"))) {
-      request->_tempFile.close();
-      request->send(304); // Not modified
-    } else if (_cache_control.length() && request->hasHeader(F("If-None-Match")) && request->header("If-None-Match").equals(etag)) {
+  if (filename.length() && filename[filename.length()-1] == '/') {
+    _sendDirectory(request, filename);
+  } else if (request->_tempFile == true) {
+    // Validators are opt-in through setCacheControl()/setLastModified(). Templated files never get them,
+    // the rendered output can change while the file stays the same
+    bool validators = !_callback && (_cache_control.length() || _last_modified.length());
+    time_t lastModified = 0;
+    String lastModifiedStr;
+    char etag[24] = "";
+    if (validators) {
+      // Explicit last modified date wins over the one kept by the filesystem
+      lastModified = _last_modified_time;
+      lastModifiedStr = _last_modified;
+      if (!lastModifiedStr.length()) {
+        lastModified = request->_tempFile.getLastWrite();
+        if (lastModified > 0)
+          lastModifiedStr = _httpDate(lastModified);
+        else
+          lastModified = 0;
+      }
+      // without a date (SPIFFS) the size is all there is, weak as it cannot tell two files of the same size apart
+      if (lastModified)
+        snprintf(etag, sizeof(etag), "\"%x-%lx\"", (unsigned int)request->_tempFile.size(), (unsigned long)lastModified);
+      else
+        snprintf(etag, sizeof(etag), "W/\"%x\"", (unsigned int)request->_tempFile.size());
+    }
+
+    AsyncWebServerResponse * response;
+    if (validators && _notModified(request, etag, lastModified, lastModifiedStr)) {
       request->_tempFile.close();
-      AsyncWebServerResponse * response = new AsyncBasicResponse(304); // Not modified
+      response = new AsyncBasicResponse(304); // Not modified
+    } else {
+      response = new AsyncFileResponse(request->_tempFile, filename, String(), false, _callback);
+    }
+    if (lastModifiedStr.length())
+      response->addHeader(F("Last-Modified"), lastModifiedStr);
+    if (_cache_control.length())
       response->addHeader(F("Cache-Control"), _cache_control);
+    if (etag[0])
       response->addHeader(F("ETag"), etag);
-      request->send(response);
+    request->send(response);
+  } else {
+    request->send(404);
+  }
+}
+
+/*
+ * Directory listing, streamed one entry at a time through a chunked response
+ * */
+
+static void _escapeHtml(String& out, const String& text){
+  for (size_t i = 0; i < text.length(); i++) {
+    char c = text[i];
+    if (c == '&') out += F("&amp;");
+    else if (c == '<') out += F("&lt;");
+    else if (c == '>') out += F("&gt;");
+    else if (c == '"') out += F("&quot;");
+    else out += c;
+  }
+}
+
+static void _escapeJson(String& out, const String& text){
+  char buf[8];
+  for (size_t i = 0; i < text.length(); i++) {
+    char c = text[i];
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if ((uint8_t)c < 0x20) {
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      out += buf;
+    } else {
+      out += c;
+    }
+  }
+}
+
+static void _escapeUrl(String& out, const String& text){
+  static const char hex[] = "0123456789ABCDEF";
+  for (size_t i = 0; i < text.length(); i++) {
+    uint8_t c = text[i];
+    if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' || c == '/') {
+      out += (char)c;
     } else {
-      AsyncWebServerResponse * response = new AsyncFileResponse(request->_tempFile, filename, String(), false, _callback);
-      if (_last_modified.length())
-        response->addHeader(F("Last-Modified"), _last_modified);
-      if (_cache_control.length()){
-        response->addHeader(F("Cache-Control"), _cache_control);
-        response->addHeader(F("ETag"), etag);
+      out += '%';
+      out += hex[c >> 4];
+      out += hex[c & 0x0F];
+    }
+  }
+}
+
+class AsyncDirectoryListing {
+  using File = fs::File;
+  private:
+#ifdef ESP32
+    File _dir;
+#else
+    fs::Dir _dir;
+#endif
+    String _uri;
+    bool _json;
+    size_t _offset;
+    size_t _limit;
+    size_t _skipped;
+    size_t _emitted;
+    uint8_t _stage;
+    String _pending;
+    size_t _pendingIndex;
+
+    bool _next(String& name, size_t& size, bool& isDir){
+#ifdef ESP32
+      File entry = _dir.openNextFile();
+      if (!entry)
+        return false;
+      name = entry.name();
+      size = entry.size();
+      isDir = entry.isDirectory();
+      entry.close();
+#else
+      if (!_dir.next())
+        return false;
+      name = _dir.fileName();
+      size = _dir.fileSize();
+      isDir = _dir.isDirectory();
+#endif
+      // some filesystems report the full path
+      int slash = name.lastIndexOf('/');
+      if (slash >= 0)
+        name = name.substring(slash + 1);
+      return true;
+    }
+
+    void _head(){
+      if (_json) {
+        _pending = F("{\"path\":\"");
+        _escapeJson(_pending, _uri);
+        _pending += F("\",\"offset\":");
+        _pending += String(_offset);
+        _pending += F(",\"entries\":[");
+      } else {
+        _pending = F("<!DOCTYPE html><html><head><meta charset=\"utf-8\"><title>Index of ");
+        _escapeHtml(_pending, _uri);
+        _pending += F("</title></head><body><h1>Index of ");
+        _escapeHtml(_pending, _uri);
+        _pending += F("</h1><ul><li><a href=\"../\">../</a></li>\n");
       }
-      request->send(response);
     }
-  } else {
-    request->send(404);
+
+    void _entry(const String& name, size_t size, bool isDir){
+      if (_json) {
+        _pending = _emitted ? F(",\n{\"name\":\"") : F("\n{\"name\":\"");
+        _escapeJson(_pending, name);
+        _pending += F("\",\"size\":");
+        _pending += String(size);
+        _pending += isDir ? F(",\"dir\":true}") : F(",\"dir\":false}");
+      } else {
+        _pending = F("<li><a href=\"");
+        _escapeUrl(_pending, _uri + name);
+        if (isDir) _pending += '/';
+        _pending += F("\">");
+        _escapeHtml(_pending, name);
+        if (isDir) {
+          _pending += F("/</a></li>\n");
+        } else {
+          _pending += F("</a> ");
+          _pending += String(size);
+          _pending += F("</li>\n");
+        }
+      }
+    }
+
+    void _tail(bool more){
+      if (_json) {
+        _pending = more ? F("\n],\"more\":true}") : F("\n],\"more\":false}");
+      } else {
+        _pending = F("</ul>");
+        if (more) {
+          _pending += F("<a href=\"?offset=");
+          _pending += String(_offset + _limit);
+          _pending += F("&amp;limit=");
+          _pending += String(_limit);
+          _pending += F("\">More</a>");
+        }
+        _pending += F("</body></html>");
+      }
+    }
+
+  public:
+#ifdef ESP32
+    AsyncDirectoryListing(File dir, const String& uri, bool json, size_t offset, size_t limit)
+#else
+    AsyncDirectoryListing(fs::Dir dir, const String& uri, bool json, size_t offset, size_t limit)
+#endif
+      : _dir(dir), _uri(uri), _json(json), _offset(offset), _limit(limit), _skipped(0), _emitted(0), _stage(0), _pending(), _pendingIndex(0) {}
+    ~AsyncDirectoryListing(){
+#ifdef ESP32
+      if (_dir)
+        _dir.close();
+#endif
+    }
+
+    size_t fill(uint8_t *buf, size_t maxLen){
+      size_t len = 0;
+      while (len < maxLen) {
+        if (_pendingIndex < _pending.length()) {
+          size_t n = std::min((size_t)(_pending.length() - _pendingIndex), maxLen - len);
+          memcpy(buf + len, _pending.c_str() + _pendingIndex, n);
+          _pendingIndex += n;
+          len += n;
+          continue;
+        }
+        _pending = String();
+        _pendingIndex = 0;
+        if (_stage == 0) {
+          _head();
+          _stage = 1;
+        } else if (_stage == 1) {
+          String name;
+          size_t size = 0;
+          bool isDir = false;
+          bool found = _next(name, size, isDir);
+          while (found && _skipped < _offset) {
+            _skipped++;
+            found = _next(name, size, isDir);
+          }
+          if (found && _limit && _emitted == _limit) {
+            // one entry past the page tells there is more to list
+            _tail(true);
+            _stage = 2;
+          } else if (found) {
+            _entry(name, size, isDir);
+            _emitted++;
+          } else {
+            _tail(false);
+            _stage = 2;
+          }
+        } else {
+          break;
+        }
+      }
+      return len;
+    }
+};
+
+void AsyncStaticWebHandler::_sendDirectory(AsyncWebServerRequest *request, const String& path __attribute__((unused)))
+{
+  String uri = request->url();
+  if (!uri.length() || uri[uri.length()-1] != '/')
+    uri += '/';
+
+  bool json = (request->hasParam(F("format")) && request->getParam(F("format"), false, false)->value() == "json")
+    || (request->hasHeader(F("Accept")) && request->header(F("Accept")).indexOf(F("application/json")) >= 0);
+
+  // negative values are ignored, they would wrap around as size_t
+  size_t offset = 0;
+  size_t limit = _dirPageSize;
+  if (request->hasParam(F("offset"))) {
+    long requested = request->getParam(F("offset"), false, false)->value().toInt();
+    if (requested > 0)
+      offset = requested;
+  }
+  if (request->hasParam(F("limit"))) {
+    long requested = request->getParam(F("limit"), false, false)->value().toInt();
+    if (requested > 0 && (!limit || (size_t)requested < limit))
+      limit = requested;
   }
+
+#ifdef ESP32
+  std::shared_ptr<AsyncDirectoryListing> listing(new AsyncDirectoryListing(request->_tempFile, uri, json, offset, limit));
+  request->_tempFile = File();
+#else
+  std::shared_ptr<AsyncDirectoryListing> listing(new AsyncDirectoryListing(_fs.openDir(path), uri, json, offset, limit));
+#endif
+  AsyncWebServerResponse *response = request->beginChunkedResponse(json ? F("application/json") : F("text/html"),
+    [listing](uint8_t *buffer, size_t maxLen, size_t index __attribute__((unused))) -> size_t {
+      return listing->fill(buffer, maxLen);
+    });
+  response->addHeader(F("Cache-Control"), F("no-cache"));
+  request->send(response);
+}
+
+bool AsyncStaticWebHandler::_notModified(AsyncWebServerRequest *request, const String& etag, time_t lastModified, const String& lastModifiedStr)
+{
+  // If-None-Match takes precedence, If-Modified-Since is only evaluated without it (RFC 7232 6)
+  if (etag.length() && request->hasHeader(F("If-None-Match")))
+    return _etagMatches(request->header(F("If-None-Match")), etag);
+
+  if (!lastModifiedStr.length() || !request->hasHeader(F("If-Modified-Since")))
+    return false;
+
+  const String& since = request->header(F("If-Modified-Since"));
+  time_t sinceTime;
+  if (lastModified && _parseHttpDate(since.c_str(), &sinceTime))
+    return lastModified <= sinceTime;
+  return since == lastModifiedStr;
 }
@@ -0,0 +1,400 @@
+/*
+  Asynchronous WebServer library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include "WebSocketDeflate.h"
+
+static const uint16_t _lengthBase[29] = {3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+static const uint8_t _lengthExtra[29] = {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+static const uint16_t _distBase[30] = {1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+static const uint8_t _distExtra[30] = {0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+
+/*
+ * Compression
+ * LZ77 with a single probe hash table, encoded in one block with the fixed Huffman codes
+ */
+
+typedef struct {
+  uint8_t *out;
+  size_t len;
+  size_t size;
+  uint32_t bits;
+  uint8_t count;
+} DeflateWriter;
+
+static bool _putBits(DeflateWriter *w, uint32_t value, uint8_t n){
+  w->bits |= value << w->count;
+  w->count += n;
+  while(w->count >= 8){
+    if(w->len == w->size)
+      return false;
+    w->out[w->len++] = w->bits & 0xFF;
+    w->bits >>= 8;
+    w->count -= 8;
+  }
+  return true;
+}
+
+//Huffman codes are sent starting with their most significant bit
+static uint16_t _reverse(uint16_t code, uint8_t n){
+  uint16_t r = 0;
+  while(n--){
+    r = (r << 1) | (code & 1);
+    code >>= 1;
+  }
+  return r;
+}
+
+static bool _putSymbol(DeflateWriter *w, uint16_t sym){
+  if(sym < 144)
+    return _putBits(w, _reverse(0x30 + sym, 8), 8);
+  if(sym < 256)
+    return _putBits(w, _reverse(0x190 + sym - 144, 9), 9);
+  if(sym < 280)
+    return _putBits(w, _reverse(sym - 256, 7), 7);
+  return _putBits(w, _reverse(0xC0 + sym - 280, 8), 8);
+}
+
+static bool _putMatch(DeflateWriter *w, size_t length, size_t distance){
+  uint8_t i = 28;
+  while(_lengthBase[i] > length)
+    i--;
+  if(!_putSymbol(w, 257 + i) || !_putBits(w, length - _lengthBase[i], _lengthExtra[i]))
+    return false;
+  i = 29;
+  while(_distBase[i] > distance)
+    i--;
+  return _putBits(w, _reverse(i, 5), 5) && _putBits(w, distance - _distBase[i], _distExtra[i]);
+}
+
+static inline uint32_t _hash(const uint8_t *p){
+  return (uint32_t)(((uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2]) * 2654435761U) >> (32 - WS_DEFLATE_HASH_BITS);
+}
+
+uint8_t * webSocketDeflate(const uint8_t * data, size_t len, uint8_t windowBits, size_t * outLen){
+  if(windowBits < 8 || windowBits > 15)
+    windowBits = 15;
+  const size_t window = 1 << windowBits;
+  //positions are kept modulo 64K, every candidate is compared before it is used
+  uint16_t *head = (uint16_t*)calloc(1 << WS_DEFLATE_HASH_BITS, sizeof(uint16_t));
+  DeflateWriter w = { (uint8_t*)malloc(len), 0, len, 0, 0 };
+  if(head == NULL || w.out == NULL){
+    free(head);
+    free(w.out);
+    return NULL;
+  }
+
+  bool ok = _putBits(&w, 0x02, 3); //not final, fixed codes
+  size_t i = 0;
+  while(ok && i < len){
+    size_t length = 0;
+    size_t distance = 0;
+    if(i + 3 <= len){
+      uint32_t h = _hash(data + i);
+      size_t d = (uint16_t)(i - head[h]);
+      head[h] = i;
+      if(d && d <= window && d <= i){
+        const uint8_t *a = data + i;
+        const uint8_t *b = a - d;
+        size_t max = std::min((size_t)258, len - i);
+        size_t n = 0;
+        while(n < max && a[n] == b[n])
+          n++;
+        if(n >= 3){
+          length = n;
+          distance = d;
+        }
+      }
+    }
+    if(length){
+      ok = _putMatch(&w, length, distance);
+      for(size_t j = i + 1; j < i + length && j + 3 <= len; j++)
+        head[_hash(data + j)] = j;
+      i += length;
+    } else {
+      ok = _putSymbol(&w, data[i++]);
+    }
+  }
+  //end of block, then the empty stored block of a sync flush without its 00 00 ff ff
+  ok = ok && _putSymbol(&w, 256) && _putBits(&w, 0, 3) && (w.count == 0 || _putBits(&w, 0, 8 - w.count));
+  free(head);
+  if(!ok){
+    free(w.out);
+    return NULL;
+  }
+  *outLen = w.len;
+  return w.out;
+}
+
+/*
+ * Decompression
+ * Stored, fixed and dynamic blocks, decoded canonically bit by bit
+ */
+
+typedef struct {
+  uint16_t counts[16];
+  uint16_t symbols[288];
+} InflateTree;
+
+typedef struct {
+  const uint8_t *in;
+  size_t inLen;
+  size_t pos;
+  uint32_t bits;
+  uint8_t count;
+  uint8_t *out;
+  size_t len;
+  size_t size;
+  size_t maxLen;
+  bool tooBig;
+  InflateTree lit;
+  InflateTree dist;
+  uint8_t lengths[320];
+} InflateState;
+
+//the 00 00 ff ff the sender removed is put back behind the message
+static const uint8_t _flushTail[4] = {0x00, 0x00, 0xff, 0xff};
+
+static int _getByte(InflateState *s){
+  if(s->pos < s->inLen)
+    return s->in[s->pos++];
+  if(s->pos < s->inLen + 4)
+    return _flushTail[s->pos++ - s->inLen];
+  return -1;
+}
+
+static int32_t _getBits(InflateState *s, uint8_t n){
+  while(s->count < n){
+    int b = _getByte(s);
+    if(b < 0)
+      return -1;
+    s->bits |= (uint32_t)b << s->count;
+    s->count += 8;
+  }
+  int32_t v = s->bits & ((1UL << n) - 1);
+  s->bits >>= n;
+  s->count -= n;
+  return v;
+}
+
+static bool _buildTree(InflateTree *t, const uint8_t *lengths, uint16_t num){
+  uint16_t offs[16];
+  memset(t->counts, 0, sizeof(t->counts));
+  for(uint16_t i = 0; i < num; i++)
+    t->counts[lengths[i]]++;
+  t->counts[0] = 0;
+  int32_t left = 1;
+  for(uint8_t i = 1; i < 16; i++){
+    left = (left << 1) - t->counts[i];
+    if(left < 0)
+      return false;
+  }
+  offs[1] = 0;
+  for(uint8_t i = 1; i < 15; i++)
+    offs[i + 1] = offs[i] + t->counts[i];
+  for(uint16_t i = 0; i < num; i++){
+    if(lengths[i])
+      t->symbols[offs[lengths[i]]++] = i;
+  }
+  return true;
+}
+
+static int _decode(InflateState *s, const InflateTree *t){
+  int32_t code = 0, first = 0, index = 0;
+  for(uint8_t len = 1; len < 16; len++){
+    int32_t b = _getBits(s, 1);
+    if(b < 0)
+      return -1;
+    code |= b;
+    int32_t count = t->counts[len];
+    if(code - count < first)
+      return t->symbols[index + (code - first)];
+    index += count;
+    first = (first + count) << 1;
+    code <<= 1;
+  }
+  return -1;
+}
+
+static bool _reserve(InflateState *s, size_t n){
+  if(s->len + n <= s->size)
+    return true;
+  if(n > s->maxLen - s->len){
+    s->tooBig = true;
+    return false;
+  }
+  size_t size = std::min(std::max(s->size * 2, s->len + n), s->maxLen);
+  uint8_t *out = (uint8_t*)realloc(s->out, size + 1);
+  if(out == NULL)
+    return false;
+  s->out = out;
+  s->size = size;
+  return true;
+}
+
+static bool _inflateStored(InflateState *s){
+  s->bits = 0;
+  s->count = 0;
+  int a = _getByte(s), b = _getByte(s), c = _getByte(s), d = _getByte(s);
+  if(d < 0)
+    return false;
+  size_t len = a | (b << 8);
+  if(len != (size_t)((c | (d << 8)) ^ 0xFFFF) || !_reserve(s, len))
+    return false;
+  while(len--){
+    int v = _getByte(s);
+    if(v < 0)
+      return false;
+    s->out[s->len++] = v;
+  }
+  return true;
+}
+
+static bool _dynamicTrees(InflateState *s){
+  static const uint8_t order[19] = {16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15};
+  int32_t hlit = _getBits(s, 5), hdist = _getBits(s, 5), hclen = _getBits(s, 4);
+  if(hclen < 0)
+    return false;
+  hlit += 257;
+  hdist += 1;
+  hclen += 4;
+  if(hlit > 286 || hdist > 30)
+    return false;
+  memset(s->lengths, 0, 19);
+  for(int32_t i = 0; i < hclen; i++){
+    int32_t l = _getBits(s, 3);
+    if(l < 0)
+      return false;
+    s->lengths[order[i]] = l;
+  }
+  if(!_buildTree(&s->lit, s->lengths, 19))
+    return false;
+  int32_t n = 0;
+  while(n < hlit + hdist){
+    int sym = _decode(s, &s->lit);
+    if(sym < 0)
+      return false;
+    if(sym < 16){
+      s->lengths[n++] = sym;
+      continue;
+    }
+    uint8_t value = 0;
+    int32_t repeat;
+    if(sym == 16){
+      if(n == 0)
+        return false;
+      value = s->lengths[n - 1];
+      repeat = _getBits(s, 2) + 3;
+    } else if(sym == 17){
+      repeat = _getBits(s, 3) + 3;
+    } else {
+      repeat = _getBits(s, 7) + 11;
+    }
+    if(repeat < 3 || n + repeat > hlit + hdist)
+      return false;
+    while(repeat--)
+      s->lengths[n++] = value;
+  }
+  return _buildTree(&s->lit, s->lengths, hlit) && _buildTree(&s->dist, s->lengths + hlit, hdist);
+}
+
+static void _fixedTrees(InflateState *s){
+  uint16_t i = 0;
+  for(; i < 144; i++) s->lengths[i] = 8;
+  for(; i < 256; i++) s->lengths[i] = 9;
+  for(; i < 280; i++) s->lengths[i] = 7;
+  for(; i < 288; i++) s->lengths[i] = 8;
+  _buildTree(&s->lit, s->lengths, 288);
+  memset(s->lengths, 5, 30);
+  _buildTree(&s->dist, s->lengths, 30);
+}
+
+static bool _inflateBlock(InflateState *s){
+  while(true){
+    int sym = _decode(s, &s->lit);
+    if(sym < 0)
+      return false;
+    if(sym < 256){
+      if(!_reserve(s, 1))
+        return false;
+      s->out[s->len++] = sym;
+      continue;
+    }
+    if(sym == 256)
+      return true;
+    sym -= 257;
+    if(sym >= 29)
+      return false;
+    int32_t extra = _getBits(s, _lengthExtra[sym]);
+    int d = _decode(s, &s->dist);
+    if(extra < 0 || d < 0 || d >= 30)
+      return false;
+    size_t length = _lengthBase[sym] + extra;
+    extra = _getBits(s, _distExtra[d]);
+    if(extra < 0)
+      return false;
+    size_t distance = _distBase[d] + extra;
+    if(distance > s->len || !_reserve(s, length))
+      return false;
+    const uint8_t *from = s->out + s->len - distance;
+    for(size_t i = 0; i < length; i++)
+      s->out[s->len++] = from[i];
+  }
+}
+
+uint8_t * webSocketInflate(const uint8_t * data, size_t len, size_t maxLen, size_t * outLen, bool * tooBig){
+  InflateState *s = (InflateState*)malloc(sizeof(InflateState));
+  if(s == NULL)
+    return NULL;
+  memset(s, 0, offsetof(InflateState, lit));
+  s->in = data;
+  s->inLen = len;
+  s->maxLen = maxLen;
+
+  bool ok = true;
+  bool final = false;
+  while(ok && !final && s->pos < s->inLen + 4){
+    int32_t head = _getBits(s, 3);
+    if(head < 0){
+      ok = false;
+      break;
+    }
+    final = head & 1;
+    switch(head >> 1){
+      case 0: ok = _inflateStored(s); break;
+      case 1: _fixedTrees(s); ok = _inflateBlock(s); break;
+      case 2: ok = _dynamicTrees(s) && _inflateBlock(s); break;
+      default: ok = false; break;
+    }
+  }
+  if(ok && s->out == NULL)
+    s->out = (uint8_t*)malloc(1);
+  uint8_t *out = s->out;
+  if(!ok || out == NULL){
+    if(tooBig != NULL)
+      *tooBig = s->tooBig;
+    free(out);
+    free(s);
+    return NULL;
+  }
+  out[s->len] = 0;
+  *outLen = s->len;
+  free(s);
+  return out;
+}
@@ -0,0 +1,45 @@
+/*
+  Asynchronous WebServer library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef WEB_SOCKET_DEFLATE_H_
+#define WEB_SOCKET_DEFLATE_H_
+
+#include "Arduino.h"
+
+//size of the match finder's hash table (2 bytes per entry), allocated for each compressed message
+#ifndef WS_DEFLATE_HASH_BITS
+#ifdef ESP32
+#define WS_DEFLATE_HASH_BITS 12
+#else
+#define WS_DEFLATE_HASH_BITS 10
+#endif
+#endif
+
+//raw DEFLATE as used by permessage-deflate (RFC 7692) without context takeover.
+//returns a malloc'ed buffer with the message compressed and the trailing 00 00 ff ff removed,
+//or NULL when there is not enough memory or the data does not shrink
+uint8_t * webSocketDeflate(const uint8_t * data, size_t len, uint8_t windowBits, size_t * outLen);
+
+//inflates a whole compressed message into a malloc'ed, NUL terminated buffer.
+//returns NULL on corrupt data or when the result would be longer than maxLen, in which case tooBig is set
+uint8_t * webSocketInflate(const uint8_t * data, size_t len, size_t maxLen, size_t * outLen, bool * tooBig);
+
+#endif